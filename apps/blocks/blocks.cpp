@@ -113,12 +113,13 @@ extern "C" void main(int argc, char** argv) {
     SyscallWinRedraw(layer_id);
 
     static unsigned long prev_timeout = 0;
+    uint64_t timer;
     if (prev_timeout == 0) {
-      const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate);
+      const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, 1000 / kFrameRate, &timer);
       prev_timeout = timeout.value;
     } else {
       prev_timeout += 1000 / kFrameRate;
-      SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+      SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout, &timer);
     }
 
     AppEvent events[1];
@@ -128,6 +129,7 @@ extern "C" void main(int argc, char** argv) {
         //draw new frame
         break;
       } else if (events[0].type == AppEvent::kQuit) {
+        SyscallCancelTimer(timer);
         running = false;
         break;
       } else if (events[0].type == AppEvent::kKeyPush) {
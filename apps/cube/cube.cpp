@@ -169,12 +169,13 @@ void DrawSurface(uint64_t layer_id, int sur) {
 
 bool Sleep(unsigned long ms) {
   static unsigned long prev_timeout = 0;
+  uint64_t timer;
   if (prev_timeout == 0) {
-    const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms);
+    const auto timeout = SyscallCreateTimer(TIMER_ONESHOT_REL, 1, ms, &timer);
     prev_timeout = timeout.value;
   } else {
     prev_timeout += ms;
-    SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout);
+    SyscallCreateTimer(TIMER_ONESHOT_ABS, 1, prev_timeout, &timer);
   }
 
   AppEvent events[1];
@@ -183,6 +184,7 @@ bool Sleep(unsigned long ms) {
     if (events[0].type == AppEvent::kTimerTimeout) {
       return false;
     } else if (events[0].type == AppEvent::kQuit) {
+      SyscallCancelTimer(timer);
       return true;
     }
   }
@@ -66,7 +66,7 @@ caddr_t sbrk(int incr) {
 
   if (dpage_end == 0 || dpage_end < program_break + incr) {
     int num_pages = (incr + 4096-1) / 4096;
-    struct SyscallResult res = SyscallDemandPages(num_pages, 0);
+    struct SyscallResult res = SyscallDemandPages(num_pages, DPAGE_FAULT_AROUND);
     if (res.error) {
       errno = ENOMEM;
       return (caddr_t)-1;
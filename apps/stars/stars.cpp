@@ -19,7 +19,8 @@ extern "C" void main(int argc, char** argv) {
     num_stars = atoi(argv[1]);
   }
 
-  auto [tick_start, timer_freq] = SyscallGetCurrentTick();
+  const auto clock_page = reinterpret_cast<const ClockPage*>(CLOCK_PAGE_ADDR);
+  const auto ns_start = ClockPageNanoseconds(clock_page);
 
   std::default_random_engine rand_engine;
   std::uniform_int_distribution x_dist(0, kWidth - 2), y_dist(0, kHeight - 2);
@@ -31,10 +32,8 @@ extern "C" void main(int argc, char** argv) {
 
   SyscallWinRedraw(layer_id);
 
-  auto [tick_end, _] = SyscallGetCurrentTick();
-  printf("%d stars in %lu ms.\n",
-         num_stars,
-         (tick_end - tick_start) * 1000 / timer_freq);
+  const auto us = (ClockPageNanoseconds(clock_page) - ns_start) / 1000;
+  printf("%d stars in %lu.%03lu ms.\n", num_stars, us / 1000, us % 1000);
 
   exit(0);
 }
\ No newline at end of file
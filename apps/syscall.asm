@@ -33,3 +33,6 @@ define_syscall OpenFile,         0x8000000c
 define_syscall ReadFile,         0x8000000d
 define_syscall DemandPages,      0x8000000e
 define_syscall MapFile,          0x8000000f
+define_syscall CancelTimer,      0x80000010
+define_syscall GetMonotonicTime, 0x80000011
+define_syscall Futex,            0x80000012
@@ -15,10 +15,14 @@ extern "C" {
 
   #include "../kernel/logger.hpp"
   #include "../kernel/app_event.hpp"
+  #include "../kernel/clock_page.hpp"
+  #include "../kernel/futex.hpp"
+  #include "../kernel/demand_paging.hpp"
 
   #define LAYER_NO_REDRAW (0x00000001ull << 32)
   #define TIMER_ONESHOT_REL 1
   #define TIMER_ONESHOT_ABS 0
+  #define TIMER_USEC 2
 
   static const int kWindowTitleHeight = 25;
   static const int kWindowMargin = 2;
@@ -37,6 +41,9 @@ extern "C" {
   struct SyscallResult SyscallWinFillRectangle(uint64_t flags_and_layer_id,
       int x, int y, int w, int h, uint32_t color);
   struct SyscallResult SyscallGetCurrentTick();
+  //value: nanoseconds, error: 1000000000. Reading the clock page does
+  //the same without a syscall
+  struct SyscallResult SyscallGetMonotonicTime();
   struct SyscallResult SyscallWinRedraw(uint64_t flags_and_layer_id);
   struct SyscallResult SyscallWinDrawLine(uint64_t flags_and_layer_id,
       int x0, int y0, int x1, int y1, uint32_t color);
@@ -44,8 +51,10 @@ extern "C" {
   struct SyscallResult SyscallCloseWindow(uint64_t flags_and_layer_id);
   struct SyscallResult SyscallReadEvent(struct AppEvent* events, size_t len);
 
+  //handle: set to the handle for SyscallCancelTimer unless it is null
   struct SyscallResult SyscallCreateTimer(unsigned int type,
-      int timer_value, unsigned long timeout_ms);
+      int timer_value, unsigned long timeout_ms, OUT uint64_t* handle);
+  struct SyscallResult SyscallCancelTimer(uint64_t handle);
 
   struct SyscallResult SyscallOpenFile(const char* path, int flags);
   struct SyscallResult SyscallReadFile(int fd, void* buf, size_t count);
@@ -53,6 +62,13 @@ extern "C" {
   struct SyscallResult SyscallDemandPages(size_t num_pages, int flags);
   struct SyscallResult SyscallMapFile(int fd,OUT size_t* file_size, int flags);
 
+  //FUTEX_WAIT: sleeps while *addr == val, at most timeout_ms unless it is
+  //0. error: EAGAIN if *addr != val, ETIMEDOUT, EINTR on any other event.
+  //Wakeups may be spurious, callers check *addr again.
+  //FUTEX_WAKE: wakes up to val waiters, value: the number woken
+  struct SyscallResult SyscallFutex(uint32_t* addr, int op, uint32_t val,
+      unsigned long timeout_ms);
+
 #ifdef __cplusplus
 } 
 #endif
\ No newline at end of file
@@ -67,6 +67,7 @@ namespace acpi {
   }
 
   const FADT* fadt;
+  const MADT* madt;
 
   void Initialize(const RSDP& rsdp) {
     if (!rsdp.IsValid()) {
@@ -81,11 +82,13 @@ namespace acpi {
     }
 
     fadt = nullptr;
+    madt = nullptr;
     for (int i = 0; i < xsdt.Count(); ++i) {
       const auto& entry = xsdt[i];
-      if (entry.IsValid("FACP")) { // FACP is the signature of FADT
+      if (fadt == nullptr && entry.IsValid("FACP")) { // FACP is the signature of FADT
         fadt = reinterpret_cast<const FADT*>(&entry);
-        break;
+      } else if (madt == nullptr && entry.IsValid("APIC")) { // APIC is the signature of MADT
+        madt = reinterpret_cast<const MADT*>(&entry);
       }
     }
 
@@ -95,6 +98,29 @@ namespace acpi {
     }
   }
 
+  size_t LocalAPICIDs(uint8_t* ids, size_t max_ids) {
+    if (madt == nullptr) {
+      return 0;
+    }
+
+    //entry: type, length, type specific fields
+    const auto begin = reinterpret_cast<const uint8_t*>(madt + 1);
+    const auto end = reinterpret_cast<const uint8_t*>(madt) + madt->header.length;
+    size_t count = 0;
+    for (auto p = begin; p + 2 <= end && p[1] >= 2; p += p[1]) {
+      //type 0: processor local APIC, 2 processor uid, 3 apic id, 4 flags
+      if (p[0] != 0 || count >= max_ids) {
+        continue;
+      }
+      const uint32_t flags = *reinterpret_cast<const uint32_t*>(p + 4);
+      //bit 0 enabled, bit 1 online capable
+      if (flags & 0b11) {
+        ids[count++] = p[3];
+      }
+    }
+    return count;
+  }
+
   void WaitMilliseconds(unsigned long msec) {
     const bool pm_timer_32 = (fadt->flags >> 8) & 1;
     const uint32_t start = IoIn32(fadt->pm_tmr_blk);
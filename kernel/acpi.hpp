@@ -55,6 +55,19 @@ namespace acpi {
   extern const FADT* fadt;
   const int kPMTimerFreq = 3579545;
 
+  //multiple APIC description table, interrupt controller entries follow
+  struct MADT {
+    DescriptionHeader header;
+
+    uint32_t local_apic_address;
+    uint32_t flags;
+  } __attribute__((packed));
+
+  extern const MADT* madt;
+
+  //stores APIC IDs of the enabled processors in the MADT, returns the count
+  size_t LocalAPICIDs(uint8_t* ids, size_t max_ids);
+
   void Initialize(const RSDP& rsdp);
   void WaitMilliseconds(unsigned long msec);
 
@@ -97,6 +97,30 @@ global GetCR3  ; uint64_t GetCR3();
 GetCR3:
     mov rax, cr3
     ret
+
+global GetCR4  ; uint64_t GetCR4();
+GetCR4:
+    mov rax, cr4
+    ret
+
+global SetCR4  ; void SetCR4(uint64_t value);
+SetCR4:
+    mov cr4, rdi
+    ret
+
+global CPUID  ; void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
+CPUID:
+    push rbx
+    mov r8, rdx
+    mov eax, edi
+    mov ecx, esi
+    cpuid
+    mov [r8], eax
+    mov [r8 + 4], ebx
+    mov [r8 + 8], ecx
+    mov [r8 + 12], edx
+    pop rbx
+    ret
     
 global InvalidateTLB  ; void InvalidateTLB(uint64_t addr);
 InvalidateTLB:
@@ -153,11 +177,26 @@ SwitchContext:  ; void SwitchContext(void* next_ctx(rdi), void* current_ctx(rsi)
     mov ax, gs
     mov [rsi + 0x38], rax
 
+    ; CR0.TS set means the FPU state was not loaded since the last switch
+    mov rax, cr0
+    test al, 8
+    jnz .fpu_saved
     fxsave [rsi + 0xc0]
+.fpu_saved:
 
 
 global RestoreContext
 RestoreContext:  ; void RestoreContext(void* ctx);
+    ; back to user mode, other CPUs may take the kernel lock.
+    ; iretq restores RFLAGS.IF
+    test qword [rdi + 0x20], 3
+    jz .kernel_mode
+    cli
+    sub rsp, 8
+    call ReleaseKernelLock
+    add rsp, 8
+.kernel_mode:
+
     ; iret stack frame
     push qword [rdi + 0x28] ; SS
     push qword [rdi + 0x70] ; RSP
@@ -166,10 +205,26 @@ RestoreContext:  ; void RestoreContext(void* ctx);
     push qword [rdi + 0x08] ; RIP
 
     ; restore context
-    fxrstor [rdi + 0xc0]
-
+    ; the FPU state is loaded lazily by IntHandlerNM while CR0.TS is set
+    mov rax, cr0
+    mov rdx, rax
+    and rdx, ~8
+    or rdx, [rdi + 0x18]
+    cmp rdx, rax
+    je .ts_done
+    mov cr0, rdx
+.ts_done:
+
+    ; skip the write (and the TLB flush) when CR3 does not change,
+    ; bit 63 is the PCID no-flush hint
     mov rax, [rdi + 0x00]
+    mov rcx, cr3
+    mov rdx, rax
+    btr rdx, 63
+    cmp rdx, rcx
+    je .cr3_done
     mov cr3, rax
+.cr3_done:
     mov rax, [rdi + 0x30]
     mov fs, ax
     mov rax, [rdi + 0x38]
@@ -206,14 +261,25 @@ CallApp:  ; int CallApp(int argc, char** argv, uint16_t ss,
     push r15
     mov [r9], rsp ; save to os_stack_ptr
 
+    ; the app runs in user mode without the kernel lock,
+    ; iretq enables interrupts together with the switch
+    cli
+    sub rsp, 8
+    call ReleaseKernelLock
+    add rsp, 8
+
     push rdx  ; SS
     push r8   ; RSP
+    pushfq
+    or qword [rsp], 0x200 ; RFLAGS.IF
     add  rdx, 8
     push rdx  ; CS
     push rcx   ; RIP
-    o64 retf
+    iretq
 
 extern LAPICTimerOnInterrupt
+extern ClaimFPU
+extern ReleaseFPU
 
 global IntHandlerLAPICTimer
 IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
@@ -222,7 +288,6 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
 
     ; make TaskContext on stack
     sub rsp, 512
-    fxsave [rsp]
     push r15
     push r14
     push r13
@@ -244,11 +309,18 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     mov bx, gs
     mov rcx, cr3
 
+    ; the FPU state is only live while CR0.TS is clear
+    mov rdx, cr0
+    and rdx, 8
+    jnz .fpu_not_live
+    fxsave [rbp - 512]
+.fpu_not_live:
+
     push rbx                 ; GS
     push rax                 ; FS
     push qword [rbp + 0x28]  ; SS
     push qword [rbp + 0x10]  ; CS
-    push rbp                 ; reserved1
+    push rdx                 ; CR0.TS
     push qword [rbp + 0x18]  ; RFLAGS
     push qword [rbp + 0x08]  ; RIP
     push rcx                 ; CR3
@@ -256,6 +328,18 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     mov rdi, rsp
     call LAPICTimerOnInterrupt
 
+    test qword [rsp + 0x18], 8
+    jnz .fpu_lazy
+    fxrstor [rbp - 512]
+    jmp .fpu_done
+.fpu_lazy:
+    ; the handler faulted the FPU in and may have clobbered it
+    mov rax, cr0
+    test al, 8
+    jnz .fpu_done
+    call ReleaseFPU
+.fpu_done:
+
     add rsp, 8*8  ; ignore from CR3 to GS 
     pop rax
     pop rbx
@@ -272,12 +356,21 @@ IntHandlerLAPICTimer:  ; void IntHandlerLAPICTimer();
     pop r13
     pop r14
     pop r15
-    fxrstor [rsp]
 
     mov rsp, rbp
     pop rbp
     iretq
 
+global IntHandlerNM
+IntHandlerNM:  ; void IntHandlerNM();
+    ; first FPU instruction since a switch, load the state of the task
+    push rax
+    clts
+    call ClaimFPU
+    fxrstor [rax]
+    pop rax
+    iretq
+
 global LoadTR
 LoadTR:  ; void LoadTR(uint16_t sel);
     ltr di
@@ -295,6 +388,8 @@ WriteMSR:  ; void WriteMSR(uint32_t msr, uint64_t value);
 
 extern GetCurrentTaskOSStackPointer
 extern syscall_table
+extern AcquireKernelLock
+extern ReleaseKernelLock
 
 global SyscallEntry
 SyscallEntry:  ; void SyscallEntry(void);
@@ -313,6 +408,7 @@ SyscallEntry:  ; void SyscallEntry(void);
     push rax
     push rdx
     cli
+    call AcquireKernelLock
     call GetCurrentTaskOSStackPointer
     sti
     mov rdx, [rsp + 0]  ; RDX
@@ -327,6 +423,13 @@ SyscallEntry:  ; void SyscallEntry(void);
 
     call [syscall_table + 8 * eax]
 
+    ; exit keeps the kernel lock, it returns to CallApp
+    cmp dword [rbp], 0x80000002
+    je .lock_kept
+    cli   ; sysret restores RFLAGS.IF
+    call ReleaseKernelLock
+.lock_kept:
+
     mov rsp, rbp
 
     pop rsi  ; restore syscallcode
@@ -355,4 +458,83 @@ ExitApp:
     pop rbp
     pop rbx
 
-    ret ; return to callapp
\ No newline at end of file
+    ret ; return to callapp
+
+
+; AP startup code. InitializeSMP copies APBootStart..APBootEnd to a frame
+; below 1MiB, patches the data part and points the SIPI vector at it.
+; The AP starts in real mode with CS:IP = frame:0, enters long mode
+; directly and calls entry(cpu) on the given stack.
+bits 16
+global APBootStart
+APBootStart:
+    cli
+    mov ax, cs
+    mov ds, ax
+
+    lgdt [APBootGDTR - APBootStart]
+
+    mov eax, cr4
+    or eax, 1 << 5  ; PAE
+    mov cr4, eax
+    mov eax, [APBootCR3 - APBootStart]
+    mov cr3, eax
+
+    mov ecx, 0xc0000080  ; IA32_EFER
+    rdmsr
+    or eax, 1 << 8  ; LME
+    wrmsr
+
+    mov eax, cr0
+    or eax, 0x80000001  ; PG, PE
+    mov cr0, eax
+    o32 jmp far [APBootJump - APBootStart]
+
+bits 64
+global APBoot64
+APBoot64:
+    mov ax, 0x10
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    xor ax, ax
+    mov fs, ax
+    mov gs, ax
+
+    ; CR4 first: OSFXSR and PCIDE (CR3 has no PCID bits yet)
+    mov rax, [rel APBootCR4]
+    mov cr4, rax
+    mov rax, [rel APBootCR0]
+    mov cr0, rax
+    mov rsp, [rel APBootStack]
+    mov edi, [rel APBootCPU]
+    mov rax, [rel APBootEntry]
+    call rax
+.fin:
+    hlt
+    jmp .fin
+
+align 16
+global APBootGDT
+APBootGDT:
+    dq 0
+    dq 0x00af9a000000ffff  ; 0x08: 64 bit code
+    dq 0x00cf92000000ffff  ; 0x10: data
+global APBootGDTR
+APBootGDTR:
+    dw 3 * 8 - 1
+    dd 0  ; linear address of APBootGDT
+global APBootJump
+APBootJump:
+    dd 0  ; linear address of APBoot64
+    dw 0x08
+align 8
+global APBootCR3, APBootCR0, APBootCR4, APBootStack, APBootEntry, APBootCPU
+APBootCR3:   dq 0
+APBootCR0:   dq 0
+APBootCR4:   dq 0
+APBootStack: dq 0
+APBootEntry: dq 0
+APBootCPU:   dq 0
+global APBootEnd
+APBootEnd:
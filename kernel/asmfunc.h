@@ -15,13 +15,23 @@ extern "C" {
   uint64_t GetCR2();
   void SetCR3(uint64_t value);
   uint64_t GetCR3();
+  uint64_t GetCR4();
+  void SetCR4(uint64_t value);
+  void CPUID(uint32_t leaf, uint32_t subleaf, uint32_t* regs);
   void InvalidateTLB(uint64_t addr);
   void SwitchContext(void* next_ctx, void* current_ctx);
   void RestoreContext(void* ctx);
   int CallApp(int argc, char** argv, uint16_t ss, uint64_t rip, uint64_t rsp, uint64_t* os_stack_ptr);
   void IntHandlerLAPICTimer();
+  void IntHandlerNM();
   void LoadTR(uint16_t sel);
   void WriteMSR(uint32_t msr, uint64_t value);
   void SyscallEntry(void);
   void ExitApp(uint64_t rsp, int32_t ret_val);
+
+  //AP startup code and the fields InitializeSMP patches in its copy
+  extern char APBootStart[], APBoot64[], APBootEnd[];
+  extern char APBootGDT[], APBootGDTR[], APBootJump[];
+  extern char APBootCR3[], APBootCR0[], APBootCR4[];
+  extern char APBootStack[], APBootEntry[], APBootCPU[];
 }
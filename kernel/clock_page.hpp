@@ -0,0 +1,28 @@
+#pragma once
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//page mapped read-only into every app, apps read the monotonic clock
+//of the kernel from it without a syscall
+#define CLOCK_PAGE_ADDR 0xffffffffffffe000ul
+
+struct ClockPage {
+  //TSC value at 0 ns
+  uint64_t tsc_base;
+  //ns = (tsc - tsc_base) * mult >> shift
+  uint64_t mult;
+  uint32_t shift;
+  //1: the TSC runs at a constant rate in all power states
+  uint32_t tsc_invariant;
+};
+
+static inline uint64_t ClockPageNanoseconds(const volatile struct ClockPage* page) {
+  const uint64_t cycles = __builtin_ia32_rdtsc() - page->tsc_base;
+  return (uint64_t)(((unsigned __int128)cycles * page->mult) >> page->shift);
+}
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
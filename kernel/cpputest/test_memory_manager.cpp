@@ -1,3 +1,9 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
 #include <CppUTest/CommandLineTestRunner.h>
 #include "memory_manager.hpp"
 
@@ -65,3 +71,215 @@ TEST(MemoryManager, SetMemoryRange) {
   CHECK_EQUAL(0, frame1.value.ID());
   CHECK_EQUAL(10, frame2.value.ID());
 }
+
+TEST(MemoryManager, BuddyAllocateAligned) {
+  mgr.MarkAllocated(FrameID{0}, 1);
+  const auto frame1 = mgr.Allocate(4);
+  const auto frame2 = mgr.Allocate(BitmapMemoryManager::kBitsPerMapLine * 2);
+
+  CHECK_EQUAL(4, frame1.value.ID());
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 2, frame2.value.ID());
+}
+
+TEST(MemoryManager, BuddyFreeCoalesce) {
+  const auto frame1 = mgr.Allocate(BitmapMemoryManager::kBitsPerMapLine);
+  const auto frame2 = mgr.Allocate(BitmapMemoryManager::kBitsPerMapLine);
+  mgr.Free(frame1.value, BitmapMemoryManager::kBitsPerMapLine);
+  mgr.Free(frame2.value, BitmapMemoryManager::kBitsPerMapLine);
+  const auto frame3 = mgr.Allocate(BitmapMemoryManager::kBitsPerMapLine * 2);
+
+  CHECK_EQUAL(0, frame3.value.ID());
+}
+
+TEST(MemoryManager, BuddyFallbackUnaligned) {
+  mgr.SetMemoryRange(FrameID{0}, FrameID{8});
+  mgr.MarkAllocated(FrameID{0}, 1);
+  mgr.MarkAllocated(FrameID{7}, 1);
+  const auto frame1 = mgr.Allocate(6);
+
+  CHECK_EQUAL(1, frame1.value.ID());
+}
+
+TEST(MemoryManager, NextFitSkipsFullLines) {
+  mgr.SetPolicy(FrameAllocPolicy::kNextFit);
+  mgr.MarkAllocated(FrameID{0}, BitmapMemoryManager::kBitsPerMapLine * 2 + 5);
+  const auto frame1 = mgr.Allocate(1);
+  const auto frame2 = mgr.Allocate(1);
+
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 2 + 5, frame1.value.ID());
+  CHECK_EQUAL(frame1.value.ID() + 1, frame2.value.ID());
+}
+
+TEST(MemoryManager, NextFitRunAcrossLines) {
+  mgr.SetPolicy(FrameAllocPolicy::kNextFit);
+  mgr.MarkAllocated(FrameID{0}, BitmapMemoryManager::kBitsPerMapLine - 3);
+  mgr.MarkAllocated(FrameID{BitmapMemoryManager::kBitsPerMapLine + 2}, 1);
+  const auto frame1 = mgr.Allocate(6);
+
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine + 3, frame1.value.ID());
+}
+
+TEST(MemoryManager, NextFitWrapAround) {
+  mgr.SetPolicy(FrameAllocPolicy::kNextFit);
+  mgr.SetMemoryRange(FrameID{0}, FrameID{16});
+  const auto frame1 = mgr.Allocate(10);
+  mgr.Free(frame1.value, 10);
+  const auto frame2 = mgr.Allocate(8);
+
+  CHECK_EQUAL(0, frame1.value.ID());
+  CHECK_EQUAL(0, frame2.value.ID());
+}
+
+TEST(MemoryManager, MarkAllocatedWholeLines) {
+  mgr.MarkAllocated(FrameID{3}, BitmapMemoryManager::kBitsPerMapLine * 3);
+  mgr.Free(FrameID{BitmapMemoryManager::kBitsPerMapLine}, 2);
+
+  CHECK_EQUAL(BitmapMemoryManager::kBitsPerMapLine * 3 - 2,
+              mgr.Stat().allocated_frames);
+}
+
+TEST(MemoryManager, ReleaseSharedFrame) {
+  const auto frame = mgr.Allocate(4).value;
+  mgr.AddRef(frame);
+  CHECK_EQUAL(2, mgr.RefCount(frame));
+
+  mgr.Release(frame, 4);
+  CHECK_EQUAL(1, mgr.RefCount(frame));
+  CHECK_EQUAL(4, mgr.Stat().allocated_frames);
+
+  mgr.Release(frame, 4);
+  CHECK_EQUAL(0, mgr.RefCount(frame));
+  CHECK_EQUAL(0, mgr.Stat().allocated_frames);
+}
+
+TEST_GROUP(MemoryManagerBenchmark) {
+  static const size_t kRangeFrames = 32 * 1024;
+
+  BitmapMemoryManager* mgr;
+
+  TEST_SETUP() {
+    mgr = new BitmapMemoryManager;
+    mgr->SetMemoryRange(FrameID{0}, FrameID{kRangeFrames});
+  }
+
+  TEST_TEARDOWN() {
+    delete mgr;
+  }
+
+  // fill the range with 1..32 frame chunks and free every other one
+  void Fragment() {
+    size_t frame = 0;
+    for (size_t i = 0; frame < kRangeFrames; ++i) {
+      const size_t n = std::min<size_t>(1 + i % 32, kRangeFrames - frame);
+      mgr->MarkAllocated(FrameID{frame}, n);
+      if (i % 2 == 0) {
+        mgr->Free(FrameID{frame}, n);
+      }
+      frame += n;
+    }
+  }
+
+  double Run(FrameAllocPolicy policy, size_t num_frames, int rounds) {
+    mgr->SetPolicy(policy);
+    std::vector<FrameID> frames;
+    const auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < rounds; ++r) {
+      while (true) {
+        const auto frame = mgr->Allocate(num_frames);
+        if (frame.error) {
+          break;
+        }
+        frames.push_back(frame.value);
+      }
+      for (auto it = frames.rbegin(); it != frames.rend(); ++it) {
+        mgr->Free(*it, num_frames);
+      }
+      frames.clear();
+    }
+    const auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count();
+  }
+
+  void Report(const char* name, size_t num_frames) {
+    const int kRounds = 2;
+    Fragment();
+    const auto first_fit = Run(FrameAllocPolicy::kFirstFit, num_frames, kRounds);
+    const auto buddy = Run(FrameAllocPolicy::kBuddy, num_frames, kRounds);
+    const auto next_fit = Run(FrameAllocPolicy::kNextFit, num_frames, kRounds);
+    printf("\n%s (%zu frames): first-fit %.0f us, buddy %.0f us, next-fit %.0f us\n",
+           name, num_frames, first_fit, buddy, next_fit);
+  }
+};
+
+TEST_GROUP(MemoryManagerLatency) {
+  static const size_t kRangeFrames = 256 * 1024;
+  static const int kAllocations = 4096;
+
+  BitmapMemoryManager* mgr;
+
+  TEST_SETUP() {
+    mgr = new BitmapMemoryManager;
+    mgr->SetMemoryRange(FrameID{0}, FrameID{kRangeFrames});
+  }
+
+  TEST_TEARDOWN() {
+    delete mgr;
+  }
+
+  // average ns of a single frame allocation with `percent` of the range in use
+  double Measure(FrameAllocPolicy policy, int percent) {
+    mgr->Free(FrameID{0}, kRangeFrames);
+    std::mt19937 rand_engine{1};
+    std::uniform_int_distribution<int> dist(0, 99);
+    for (size_t i = 0; i < kRangeFrames; ++i) {
+      if (dist(rand_engine) < percent) {
+        mgr->MarkAllocated(FrameID{i}, 1);
+      }
+    }
+
+    mgr->SetPolicy(policy);
+    std::vector<FrameID> frames;
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kAllocations; ++i) {
+      frames.push_back(mgr->Allocate(1).value);
+    }
+    const auto end = std::chrono::steady_clock::now();
+    for (auto frame : frames) {
+      mgr->Free(frame, 1);
+    }
+    return std::chrono::duration<double, std::nano>(end - start).count()
+        / kAllocations;
+  }
+
+  void Report(int percent) {
+    const auto first_fit = Measure(FrameAllocPolicy::kFirstFit, percent);
+    const auto buddy = Measure(FrameAllocPolicy::kBuddy, percent);
+    const auto next_fit = Measure(FrameAllocPolicy::kNextFit, percent);
+    printf("\n%d%% occupied: first-fit %.0f ns, buddy %.0f ns, next-fit %.0f ns\n",
+           percent, first_fit, buddy, next_fit);
+  }
+};
+
+TEST(MemoryManagerLatency, Occupancy10) {
+  Report(10);
+}
+
+TEST(MemoryManagerLatency, Occupancy50) {
+  Report(50);
+}
+
+TEST(MemoryManagerLatency, Occupancy90) {
+  Report(90);
+}
+
+TEST(MemoryManagerBenchmark, SingleFrameFragmented) {
+  Report("single frame", 1);
+}
+
+TEST(MemoryManagerBenchmark, PageTableRunFragmented) {
+  Report("4 frame run", 4);
+}
+
+TEST(MemoryManagerBenchmark, AppStackRunFragmented) {
+  Report("stack run", 16);
+}
@@ -0,0 +1,4 @@
+#pragma once
+
+//flags of SyscallDemandPages, shared by the kernel and apps
+#define DPAGE_FAULT_AROUND 1
@@ -3,6 +3,7 @@
 #include <cstring>
 
 #include "logger.hpp"
+#include "page_cache.hpp"
 
 namespace{
 
@@ -372,6 +373,7 @@ namespace fat32 {
           return MAKE_ERROR(Error::kInvalidFile); 
         }
 
+        page_cache->Invalidate(*file_entry);
         FreeCluster(file_entry->FirstCluster());
         file_entry->name[0]=0xe5;
         return MAKE_ERROR(Error::kSuccess);
@@ -451,6 +453,7 @@ namespace fat32 {
     }
 
     const uint8_t* buf8 = reinterpret_cast<const uint8_t*>(buf);
+    page_cache->Invalidate(_fat_entry);
 
     size_t total = 0;
     while (total < len) {
@@ -481,14 +484,18 @@ namespace fat32 {
     FileDescriptor fd{_fat_entry};
     fd._rd_off = offset;
 
-    unsigned long cluster = _fat_entry.FirstCluster();
-    while (offset >= bytes_per_cluster) {
-      offset -= bytes_per_cluster;
-      cluster = NextCluster(cluster);
+    const size_t cluster_index = offset / bytes_per_cluster;
+    if (_ld_cluster == 0 || cluster_index < _ld_cluster_index) {
+      _ld_cluster = _fat_entry.FirstCluster();
+      _ld_cluster_index = 0;
+    }
+    while (_ld_cluster_index < cluster_index) {
+      _ld_cluster = NextCluster(_ld_cluster);
+      _ld_cluster_index++;
     }
 
-    fd._rd_cluster = cluster;
-    fd._rd_cluster_off = offset;
+    fd._rd_cluster = _ld_cluster;
+    fd._rd_cluster_off = offset % bytes_per_cluster;
     return fd.Read(buf, len);
   }
 }// namespace fat
\ No newline at end of file
@@ -185,10 +185,15 @@ namespace fat32 {
       size_t Write(const void* buf, size_t len) override;
       size_t Size() const override { return _fat_entry.file_size; }
       size_t Load(void* buf, size_t len, size_t offset) override;
+      const DirectoryEntry* DirEntry() const override { return &_fat_entry; }
 
     private:
       DirectoryEntry& _fat_entry;
 
+      //cluster reached by the last Load, later loads resume from it
+      size_t _ld_cluster_index = 0;
+      unsigned long _ld_cluster = 0;
+
       size_t _rd_off = 0;
       unsigned long _rd_cluster = 0;
       size_t _rd_cluster_off = 0;
@@ -2,6 +2,10 @@
 
 #include <cstddef>
 
+namespace fat32 {
+  struct DirectoryEntry;
+}
+
 class FileDescriptor {
   public:
     virtual ~FileDescriptor() = default;
@@ -10,6 +14,8 @@ class FileDescriptor {
     virtual size_t Size() const = 0;
 
     virtual size_t Load(void* buf, size_t len, size_t offset) = 0;
+    //entry on the volume backing this file, nullptr if there is none
+    virtual const fat32::DirectoryEntry* DirEntry() const { return nullptr; }
 };
 
 size_t PrintToFD(FileDescriptor& fd, const char* format, ...);
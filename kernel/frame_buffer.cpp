@@ -1,6 +1,7 @@
 #include "frame_buffer.hpp"
 
 #include <cstring>
+#include <emmintrin.h>
 
 namespace{
   int BytesPerPixel(PixelFormat format){
@@ -20,6 +21,71 @@ namespace{
     return config.frame_buffer + BytesPerPixel(config.pixel_format) *
       (config.pixels_per_scan_line * pos.y + pos.x);
   }
+
+  const uint32_t kColorMask = 0x00ffffff;
+
+  //x / 255 rounded, exact for x <= 255 * 255
+  uint32_t Div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+  }
+
+  //the same on 16-bit lanes
+  __m128i Div255(__m128i x) {
+    x = _mm_add_epi16(x, _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
+  }
+
+  //one scanline of 32-bit pixels, 4 per SSE2 register
+  template <bool kBlend, bool kKey>
+  void BlendSpan(uint32_t* dst, const uint32_t* src, size_t n,
+                 uint8_t alpha, uint32_t key) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i a = _mm_set1_epi16(alpha);
+    const __m128i na = _mm_set1_epi16(255 - alpha);
+    const __m128i color_mask = _mm_set1_epi32(kColorMask);
+    const __m128i key4 = _mm_set1_epi32(key);
+
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+      const auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+      const auto d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i));
+      auto out = s;
+      if (kBlend) {
+        //bytes widened to 16-bit lanes, 2 pixels per half
+        const auto lo = Div255(_mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a),
+            _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), na)));
+        const auto hi = Div255(_mm_add_epi16(
+            _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a),
+            _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), na)));
+        out = _mm_packus_epi16(lo, hi);
+      }
+      if (kKey) {
+        const auto is_key = _mm_cmpeq_epi32(_mm_and_si128(s, color_mask), key4);
+        out = _mm_or_si128(_mm_and_si128(is_key, d), _mm_andnot_si128(is_key, out));
+      }
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), out);
+    }
+
+    for (; i < n; ++i) {
+      const uint32_t s = src[i];
+      if (kKey && (s & kColorMask) == key) {
+        continue;
+      }
+      if (!kBlend) {
+        dst[i] = s;
+        continue;
+      }
+      const uint32_t d = dst[i];
+      uint32_t out = 0;
+      for (int shift = 0; shift < 32; shift += 8) {
+        out |= Div255(((s >> shift) & 0xff) * alpha +
+                      ((d >> shift) & 0xff) * (255 - alpha)) << shift;
+      }
+      dst[i] = out;
+    }
+  }
 }
 
 Error FrameBuffer::Initialize(const FrameBufferConfig& config){
@@ -108,5 +174,39 @@ void FrameBuffer::Move(Vector2D<int> dst_pos, const Rectangle<int>& src){
   }
 }
 
+Error FrameBuffer::Blend(Vector2D<int> dst_pos, const FrameBuffer& src,
+    const Rectangle<int>& src_area, uint8_t alpha, const std::optional<PixelColor>& key){
+  if (_config.pixel_format != src._config.pixel_format) {
+    return MAKE_ERROR(Error::kUnknownPixelFormat);
+  }
+  if (BytesPerPixel(_config.pixel_format) != 4) {
+    return MAKE_ERROR(Error::kUnknownPixelFormat);
+  }
+
+  const Rectangle<int> src_area_shifted{dst_pos, src_area.size};
+  const Rectangle<int> src_outline{dst_pos - src_area.pos, FrameBufferSize(src._config)};
+  const Rectangle<int> dst_outline{{0, 0}, FrameBufferSize(_config)};
+  const auto copy_area = dst_outline & src_outline & src_area_shifted;
+  const auto src_start_pos = copy_area.pos - src_outline.pos;
+
+  auto span = BlendSpan<true, false>;
+  if (alpha == 0xff) {
+    if (!key) {
+      return Copy(dst_pos, src, src_area);
+    }
+    span = BlendSpan<false, true>;
+  } else if (key) {
+    span = BlendSpan<true, true>;
+  }
+  const uint32_t key_value = key ? ToPixelValue(*key, _config.pixel_format) : 0;
 
+  auto dst_buf = reinterpret_cast<uint32_t*>(FrameAddrAt(copy_area.pos, _config));
+  auto src_buf = reinterpret_cast<const uint32_t*>(FrameAddrAt(src_start_pos, src._config));
+  for (int dy = 0; dy < copy_area.size.y; dy++) {
+    span(dst_buf, src_buf, copy_area.size.x, alpha, key_value);
+    dst_buf += _config.pixels_per_scan_line;
+    src_buf += src._config.pixels_per_scan_line;
+  }
 
+  return MAKE_ERROR(Error::kSuccess);
+}
@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <memory>
+#include <optional>
 
 #include "error.hpp"
 #include "frame_buffer_config.hpp"
@@ -12,6 +13,10 @@ class FrameBuffer {
   Error Initialize(const FrameBufferConfig& config);
   Error Copy(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area);
   void Move(Vector2D<int> dst_pos, const Rectangle<int>& src);
+  //draws src_area of src at dst_pos, (src * alpha + dst * (255 - alpha)) / 255
+  //per channel. Pixels of src in the key color are left out
+  Error Blend(Vector2D<int> dst_pos, const FrameBuffer& src, const Rectangle<int>& src_area,
+              uint8_t alpha, const std::optional<PixelColor>& key);
 
   FrameBufferWriter& Writer() { return *_writer; }
   const FrameBufferConfig& Config() const { return _config; }
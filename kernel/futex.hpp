@@ -0,0 +1,5 @@
+#pragma once
+
+//operations of SyscallFutex, shared by the kernel and apps
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
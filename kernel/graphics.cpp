@@ -43,12 +43,77 @@ PixelColor BGRResv8BitPerColorPixelWriter::GetPixel(Vector2D<int> pos){
 
 
 
+void PixelWriter::FillSpan(Vector2D<int> pos, int n, const PixelColor& c){
+  for(int i = 0; i < n; i++){
+    Write(pos + Vector2D<int>{i, 0}, c);
+  }
+}
+
+void PixelWriter::BlitSpan(Vector2D<int> pos, const PixelColor* colors, int n){
+  for(int i = 0; i < n; i++){
+    Write(pos + Vector2D<int>{i, 0}, colors[i]);
+  }
+}
+
+void PixelWriter::BlitMask1bpp(Vector2D<int> pos, const uint8_t* bits, int n,
+                               const PixelColor& c){
+  for(int i = 0; i < n; i++){
+    if(bits[i >> 3] & (0x80u >> (i & 7))){
+      Write(pos + Vector2D<int>{i, 0}, c);
+    }
+  }
+}
+
+bool FrameBufferWriter::ClipSpan(Vector2D<int>& pos, int& n, int& skip){
+  if(pos.y < 0 || pos.y >= Height()){
+    return false;
+  }
+  skip = pos.x < 0 ? -pos.x : 0;
+  pos.x += skip;
+  n = std::min(n - skip, Width() - pos.x);
+  return n > 0;
+}
+
+void FrameBufferWriter::FillSpan(Vector2D<int> pos, int n, const PixelColor& c){
+  int skip;
+  if(!ClipSpan(pos, n, skip)){
+    return;
+  }
+  auto p = reinterpret_cast<uint32_t*>(PixelAt(pos));
+  std::fill_n(p, n, ToPixelValue(c, _config.pixel_format));
+}
+
+void FrameBufferWriter::BlitSpan(Vector2D<int> pos, const PixelColor* colors, int n){
+  int skip;
+  if(!ClipSpan(pos, n, skip)){
+    return;
+  }
+  auto p = reinterpret_cast<uint32_t*>(PixelAt(pos));
+  for(int i = 0; i < n; i++){
+    p[i] = ToPixelValue(colors[skip + i], _config.pixel_format);
+  }
+}
+
+void FrameBufferWriter::BlitMask1bpp(Vector2D<int> pos, const uint8_t* bits, int n,
+                                     const PixelColor& c){
+  int skip;
+  if(!ClipSpan(pos, n, skip)){
+    return;
+  }
+  auto p = reinterpret_cast<uint32_t*>(PixelAt(pos));
+  const uint32_t value = ToPixelValue(c, _config.pixel_format);
+  for(int i = 0; i < n; i++){
+    const int bit = skip + i;
+    if(bits[bit >> 3] & (0x80u >> (bit & 7))){
+      p[i] = value;
+    }
+  }
+}
+
 void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos,
                    const Vector2D<int>& size, const PixelColor& c){
-  for(int dx = 0; dx < size.x; dx++){
-    writer.Write(pos + Vector2D<int>{dx, 0}, c);
-    writer.Write(pos + Vector2D<int>{dx, size.y - 1} , c);
-  }
+  writer.FillSpan(pos, size.x, c);
+  writer.FillSpan(pos + Vector2D<int>{0, size.y - 1}, size.x, c);
   for(int dy = 1; dy < size.y -1 ; dy++){
     writer.Write(pos + Vector2D<int>{0, dy},c );
     writer.Write(pos + Vector2D<int>{size.x - 1, dy}, c);
@@ -58,9 +123,7 @@ void DrawRectangle(PixelWriter& writer, const Vector2D<int>& pos,
 void FillRectangle(PixelWriter& writer, const Vector2D<int>& pos,
                    const Vector2D<int>& size, const PixelColor& c){
   for(int dy = 0; dy < size.y; dy++){
-    for(int dx = 0; dx < size.x; dx++){
-      writer.Write(pos + Vector2D<int>{dx, dy}, c);
-    }
+    writer.FillSpan(pos + Vector2D<int>{0, dy}, size.x, c);
   }
 }
 
@@ -148,17 +211,10 @@ void FillPolygon(PixelWriter& pixel_writer, const std::vector<Vector2D<int>>& ve
       if(endIndex>=pixelXOnPolygon.size()){
         endIndex = i;
       }
-      for(int crossX=pixelXOnPolygon[i];
-            crossX<=pixelXOnPolygon[endIndex];
-            crossX++){
-        int pixelX = crossX;
-        if(pixelX<0){
-          pixelX = 0;
-        }
-        if(pixelX>=kCavasWidth){
-          pixelX = kCavasWidth - 1;
-        }
-        pixel_writer.Write(Vector2D<int>{pixelX, pixelY}, c);
+      const int startX = std::clamp(pixelXOnPolygon[i], 0, kCavasWidth - 1);
+      const int endX = std::clamp(pixelXOnPolygon[endIndex], 0, kCavasWidth - 1);
+      if(pixelXOnPolygon[i] <= pixelXOnPolygon[endIndex]){
+        pixel_writer.FillSpan(Vector2D<int>{startX, pixelY}, endX - startX + 1, c);
       }
     }
   }
@@ -131,6 +131,22 @@ Rectangle<T> operator&(const Rectangle<T>& lhs, const Rectangle<U>& rhs){
   
 }
 
+//smallest rectangle that covers both
+template<typename T>
+Rectangle<T> operator|(const Rectangle<T>& lhs, const Rectangle<T>& rhs){
+  auto new_pos = ElementMin(lhs.pos, rhs.pos);
+  auto new_size = ElementMax(lhs.pos + lhs.size, rhs.pos + rhs.size) - new_pos;
+  return {new_pos, new_size};
+}
+
+//c as stored in a 32-bit pixel of format, the reserved byte 0
+inline uint32_t ToPixelValue(const PixelColor& c, PixelFormat format) {
+  if (format == kPixelBGRResv8BitPerColor) {
+    return c.b | c.g << 8 | c.r << 16;
+  }
+  return c.r | c.g << 8 | c.b << 16;
+}
+
 class PixelWriter{
   public:
     virtual ~PixelWriter() = default;
@@ -138,6 +154,15 @@ class PixelWriter{
     virtual int Width() = 0;
     virtual int Height() = 0;
     virtual PixelColor GetPixel(Vector2D<int> pos) = 0;
+
+    //spans run n pixels to the right from pos. The defaults call Write
+    //per pixel, writers with a pixel buffer write whole spans
+    virtual void FillSpan(Vector2D<int> pos, int n, const PixelColor& c);
+    virtual void BlitSpan(Vector2D<int> pos, const PixelColor* colors, int n);
+    //pixel i gets c if bit 7 - i % 8 of bits[i / 8] is set, as in the
+    //fonts, and is left as it is if not
+    virtual void BlitMask1bpp(Vector2D<int> pos, const uint8_t* bits, int n,
+                              const PixelColor& c);
 };
 
 class FrameBufferWriter : public PixelWriter{
@@ -147,12 +172,22 @@ class FrameBufferWriter : public PixelWriter{
 
     virtual int Width() override { return _config.horizontal_resolution; }
     virtual int Height() override { return _config.vertical_resolution; }
+
+    //spans are clipped to the frame buffer
+    virtual void FillSpan(Vector2D<int> pos, int n, const PixelColor& c) override;
+    virtual void BlitSpan(Vector2D<int> pos, const PixelColor* colors, int n) override;
+    virtual void BlitMask1bpp(Vector2D<int> pos, const uint8_t* bits, int n,
+                              const PixelColor& c) override;
   protected:
     uint8_t* PixelAt(Vector2D<int> pos){
       return _config.frame_buffer + 4 * (_config.pixels_per_scan_line * pos.y + pos.x);
     }
 
   private:
+    //moves pos and shortens n to the part inside the frame buffer, skip
+    //is the number of pixels cut from the left. Returns false if none is left
+    bool ClipSpan(Vector2D<int>& pos, int& n, int& skip);
+
     const FrameBufferConfig& _config;
 };
 
@@ -9,7 +9,9 @@
 #include "task.hpp"
 #include "graphics.hpp"
 #include "font.hpp"
+#include "layer.hpp"
 #include "paging.hpp"
+#include "smp.hpp"
 
 std::array<InterruptDescriptor, 256> idt;
 
@@ -39,7 +41,11 @@ namespace {
 
   __attribute__((interrupt))
   void IntHandlerXHCI(InterruptFrame* frame){
+    KernelLockGuard lock;
     Log(kDebugMass, "IntHandlerXHCI\n");
+    if (pending_input_ns == 0) {
+      pending_input_ns = MonotonicNanoseconds();
+    }
     // main_msg_queue->Push(Message{Message::kInterruptXHCI});
     // main_msg_queue->push_back(Message{Message::kInterruptXHCI});
     task_manager->SendMessage(1, Message{Message::kInterruptXHCI});
@@ -91,6 +97,7 @@ namespace {
 
   __attribute__((interrupt))
   void IntHandlerPF(InterruptFrame* frame, uint64_t error_code) {
+    KernelLockGuard lock;
     uint64_t cr2 = GetCR2();
     if (auto err = HandlePageFault(error_code, cr2); !err) {
       return;
@@ -105,6 +112,7 @@ namespace {
 #define FaultHandlerWithError(fault_name) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame, uint64_t error_code) { \
+    KernelLockGuard lock; \
     KillApp(frame); \
     PrintFrame(frame, "#" #fault_name); \
     WriteString(*screen_pixel_writer, {500, 16*4}, "ERR", {0, 0, 0}); \
@@ -115,6 +123,7 @@ namespace {
 #define FaultHandlerNoError(fault_name) \
   __attribute__((interrupt)) \
   void IntHandler ## fault_name (InterruptFrame* frame) { \
+    KernelLockGuard lock; \
     KillApp(frame); \
     PrintFrame(frame, "#" #fault_name); \
     while (true) __asm__("hlt"); \
@@ -126,7 +135,6 @@ namespace {
   FaultHandlerNoError(OF)
   FaultHandlerNoError(BR)
   FaultHandlerNoError(UD)
-  FaultHandlerNoError(NM)
   FaultHandlerWithError(DF)
   FaultHandlerWithError(TS)
   FaultHandlerWithError(NP)
@@ -158,6 +166,12 @@ void InitializeInterrupt() {
               reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
               kKernelCS, kISTForTimer);
 
+  //runs the timer handler on another CPU, see SendRescheduleIPI
+  SetIDTEntry(idt[InterruptVector::kReschedule],
+              DescriptorType::kInterruptGate, 0,
+              reinterpret_cast<uint64_t>(IntHandlerLAPICTimer),
+              kKernelCS, kISTForTimer);
+
   auto set_idt_entry = [](int irq, auto handler) {
     SetIDTEntry(idt[irq],
                 DescriptorType::kInterruptGate, 0,
@@ -186,4 +200,9 @@ void InitializeInterrupt() {
 
   Log(kDebug, "idt: %08lx\n", reinterpret_cast<uintptr_t>(&idt[InterruptVector::kXHCI]));
   LoadIDT(sizeof(idt)-1, reinterpret_cast<uintptr_t>(&idt[0]));
+}
+
+void InitializeInterruptForAP() {
+  //all CPUs share the idt set up by the BSP
+  LoadIDT(sizeof(idt)-1, reinterpret_cast<uintptr_t>(&idt[0]));
 }
\ No newline at end of file
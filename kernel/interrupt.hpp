@@ -17,6 +17,7 @@ class InterruptVector {
   enum Number {
     kXHCI = 51,
     kLAPICTimer = 52,
+    kReschedule = 53,
   };
 };
 
@@ -55,4 +56,5 @@ void SetIDTEntry(InterruptDescriptor& desc,
                  uint8_t interrupt_stack_table = 0,bool present = true);
 
 // void InitializeInterrupt(std::deque<Message>* msg_queue);
-void InitializeInterrupt();
\ No newline at end of file
+void InitializeInterrupt();
+void InitializeInterruptForAP();
\ No newline at end of file
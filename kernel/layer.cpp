@@ -3,8 +3,10 @@
 #include <algorithm>
 
 #include "logger.hpp"
+#include "spinlock.hpp"
 #include "timer.hpp"
 #include "task.hpp"
+#include "wait_queue.hpp"
 
 namespace {
   template <class T, class U>
@@ -12,11 +14,64 @@ namespace {
     auto iter = std::remove_if(c.begin(), c.end(), pred);
     c.erase(iter, c.end());
   }
+
+  SlabCache layer_cache{"Layer", sizeof(Layer)};
+
+  //more damage rectangles than this collapse into their bounding box
+  const size_t kMaxDamageRects = 16;
+
+  bool IsEmpty(const Rectangle<int>& r) {
+    return r.size.x <= 0 || r.size.y <= 0;
+  }
+
+  //appends the parts of a outside b, at most 4 rectangles
+  void SubtractRect(const Rectangle<int>& a, const Rectangle<int>& b,
+                    std::vector<Rectangle<int>>& out) {
+    const auto i = a & b;
+    if (IsEmpty(i)) {
+      out.push_back(a);
+      return;
+    }
+    const auto a_end = a.pos + a.size;
+    const auto i_end = i.pos + i.size;
+    const Rectangle<int> parts[] = {
+      {a.pos, {a.size.x, i.pos.y - a.pos.y}},
+      {{a.pos.x, i_end.y}, {a.size.x, a_end.y - i_end.y}},
+      {{a.pos.x, i.pos.y}, {i.pos.x - a.pos.x, i.size.y}},
+      {{i_end.x, i.pos.y}, {a_end.x - i_end.x, i.size.y}},
+    };
+    for (const auto& part : parts) {
+      if (!IsEmpty(part)) {
+        out.push_back(part);
+      }
+    }
+  }
+
+  //true if a and b share a whole edge, their union is a rectangle
+  bool Adjacent(const Rectangle<int>& a, const Rectangle<int>& b) {
+    if (a.pos.x == b.pos.x && a.size.x == b.size.x) {
+      return a.pos.y + a.size.y == b.pos.y || b.pos.y + b.size.y == a.pos.y;
+    }
+    if (a.pos.y == b.pos.y && a.size.y == b.size.y) {
+      return a.pos.x + a.size.x == b.pos.x || b.pos.x + b.size.x == a.pos.x;
+    }
+    return false;
+  }
+
+  void RecordInputLatency();
 }
 
 Layer::Layer(unsigned int id) : _id{id}{
 
 }
+
+void* Layer::operator new(size_t size){
+  return layer_cache.AllocateForNew(size);
+}
+
+void Layer::operator delete(void* p){
+  layer_cache.Free(p);
+}
 unsigned int Layer::ID() const{
   return _id;
 }
@@ -52,6 +107,11 @@ bool Layer::IsTransparentable() const{
   return _transparentable;
 }
 
+bool Layer::IsOpaque() const{
+  return _window && !_window->HasTransparentColor() &&
+      !(_transparentable && globalTransparent!=0xff);
+}
+
 Layer& Layer::Move(Vector2D<int> pos){
   _pos = pos;
   return *this;
@@ -78,6 +138,14 @@ void Layer::OnClick(uint8_t button_id){
   }
 }
 
+bool Layer::FinishQueuedOps() {
+  if (_ops_queued <= _ops_done) {
+    return false;
+  }
+  _ops_done = _ops_queued;
+  return true;
+}
+
 
 void LayerManager::SetWriter(FrameBuffer* writer){
   _screen = writer;
@@ -98,68 +166,178 @@ void LayerManager::RemoveLayer(unsigned int id){
   EraseIf(_layers, pred);
 }
 
-void LayerManager::Draw(const Rectangle<int>& area) const{
-  for(auto layer : _layer_stack){
-    layer->DrawTo(_back_buffer, area, 
-        layer->IsTransparentable() && globalTransparent!=0xff);
-  }
-  _screen->Copy(area.pos, _back_buffer, area);
+void LayerManager::Draw(const Rectangle<int>& area){
+  AddDamage(area);
 }
 
-void LayerManager::Draw(unsigned int id) const{
+void LayerManager::Draw(unsigned int id){
   Draw(id, {{0, 0}, {-1, -1}});
 }
 
-void LayerManager::Draw(unsigned int id, Rectangle<int> area) const{
-  bool draw = false;
-  bool transparent = false;
-  Rectangle<int> window_area;
-  for (auto layer : _layer_stack) {
-    if (layer->ID() == id) {
-      window_area.size = layer->GetWindow()->Size();
-      window_area.pos = layer->GetPosition();
-      if (area.size.x >= 0 || area.size.y >= 0) {
-        area.pos = area.pos + window_area.pos;
-        window_area = window_area & area;
+void LayerManager::Draw(unsigned int id, Rectangle<int> area){
+  auto iter = std::find_if(_layer_stack.begin(), _layer_stack.end(),
+      [id](Layer* layer) { return layer->ID() == id; });
+  if (iter == _layer_stack.end()) {
+    return;
+  }
+  Rectangle<int> window_area{(*iter)->GetPosition(), (*iter)->GetWindow()->Size()};
+  if (area.size.x >= 0 || area.size.y >= 0) {
+    area.pos = area.pos + window_area.pos;
+    window_area = window_area & area;
+  }
+  AddDamage(window_area);
+}
+
+void LayerManager::Fresh(){
+  AddDamage({{0, 0}, ScreenSize()});
+}
+
+void LayerManager::AddDamage(Rectangle<int> area){
+  area = area & Rectangle<int>{{0, 0}, ScreenSize()};
+  if (IsEmpty(area)) {
+    return;
+  }
+
+  //keep the rectangles disjoint: add only what is not damaged yet
+  std::vector<Rectangle<int>> pieces{area}, rest;
+  for (const auto& damage : _damage) {
+    rest.clear();
+    for (const auto& piece : pieces) {
+      SubtractRect(piece, damage, rest);
+    }
+    pieces.swap(rest);
+    if (pieces.empty()) {
+      break;
+    }
+  }
+  for (const auto& piece : pieces) {
+    MergeDamage(piece);
+  }
+
+  if (_damage.size() > kMaxDamageRects) {
+    auto bounds = _damage[0];
+    for (const auto& damage : _damage) {
+      bounds = bounds | damage;
+    }
+    _damage.assign(1, bounds);
+  }
+
+  if (_frame_task_id == 0) {
+    Composite();
+  } else {
+    ScheduleFrame();
+  }
+}
+
+void LayerManager::MergeDamage(Rectangle<int> area){
+  //grow area with rectangles it shares an edge with, until none is left
+  for (auto iter = _damage.begin(); iter != _damage.end(); ) {
+    if (Adjacent(area, *iter)) {
+      area = area | *iter;
+      _damage.erase(iter);
+      iter = _damage.begin();
+    } else {
+      ++iter;
+    }
+  }
+  _damage.push_back(area);
+}
+
+void LayerManager::ScheduleFrame(){
+  if (_frame_scheduled) {
+    return;
+  }
+  InterruptGuard guard;
+  //at once after an idle period, else one frame interval after the last
+  const auto now = timer_manager->CurrentTick();
+  const auto due = std::max(now, _last_frame + kTimerFreq / kFramesPerSecond);
+  timer_manager->AddTimer(Timer{due, kCompositorTimer, _frame_task_id});
+  _frame_scheduled = true;
+}
+
+void LayerManager::StartFrames(uint64_t task_id){
+  _frame_task_id = task_id;
+}
+
+void LayerManager::Composite(){
+  _frame_scheduled = false;
+  const auto start = MonotonicNanoseconds();
+
+  //front to back: each layer gets the part of the area no opaque layer
+  //above covers, then the layers draw their parts back to front
+  struct VisibleLayer {
+    Layer* layer;
+    size_t begin, end;
+  };
+  std::vector<VisibleLayer> visible;
+  std::vector<Rectangle<int>> remaining, rest, parts;
+
+  uint64_t pixels = 0, layer_pixels = 0;
+  for (const auto& area : _damage) {
+    remaining.assign(1, area);
+    visible.clear();
+    parts.clear();
+    for (auto iter = _layer_stack.rbegin();
+         iter != _layer_stack.rend() && !remaining.empty(); ++iter) {
+      auto layer = *iter;
+      if (!layer->GetWindow()) {
+        continue;
+      }
+      const Rectangle<int> layer_area{layer->GetPosition(), layer->GetWindow()->Size()};
+      const auto begin = parts.size();
+      for (const auto& r : remaining) {
+        const auto part = r & layer_area;
+        if (!IsEmpty(part)) {
+          parts.push_back(part);
+        }
       }
-      draw = true;
-      if(layer->IsTransparentable() && globalTransparent!=0xff){
-        transparent = true;
-        break;
+      if (parts.size() == begin) {
+        continue;
       }
-    }
-    if (draw) {
-       if (layer->ID() != id){
-        Rectangle<int> temp_area;
-        temp_area.size = layer->GetWindow()->Size();
-        temp_area.pos = layer->GetPosition();
-        auto intersection_area=window_area & temp_area;
-        if(intersection_area.size.x==0 || intersection_area.size.y==0){
-          continue;
+      visible.push_back({layer, begin, parts.size()});
+
+      if (occlusion_culling && layer->IsOpaque()) {
+        rest.clear();
+        for (const auto& r : remaining) {
+          SubtractRect(r, layer_area, rest);
         }
+        remaining.swap(rest);
       }
-      layer->DrawTo(_back_buffer, window_area,
-          layer->IsTransparentable() && globalTransparent!=0xff);
     }
-  }
 
-  if(transparent){
-    Draw(window_area);
-  }else{
-    _screen->Copy(window_area.pos, _back_buffer, window_area);
+    for (auto iter = visible.rbegin(); iter != visible.rend(); ++iter) {
+      const bool transparent =
+          iter->layer->IsTransparentable() && globalTransparent!=0xff;
+      for (size_t i = iter->begin; i < iter->end; ++i) {
+        iter->layer->DrawTo(_back_buffer, parts[i], transparent);
+        layer_pixels += parts[i].size.x * parts[i].size.y;
+      }
+    }
+    _screen->Copy(area.pos, _back_buffer, area);
+    pixels += area.size.x * area.size.y;
   }
-}
 
-void LayerManager::Fresh() const{
-  for(auto layer : _layer_stack){
-    Rectangle<int> temp_area;
-    temp_area.size = ScreenSize();
-    temp_area.pos = {0 ,0};
+  if (!_damage.empty()) {
+    compositor_stat.frames++;
+    compositor_stat.rects += _damage.size();
+    compositor_stat.pixels += pixels;
+    compositor_stat.layer_pixels += layer_pixels;
+    compositor_stat.composite_ns += MonotonicNanoseconds() - start;
+    _damage.clear();
+  }
+  if (_frame_task_id != 0) {
+    InterruptGuard guard;
+    _last_frame = timer_manager->CurrentTick();
+  }
 
-    layer->DrawTo(_back_buffer, temp_area, 
-    layer->IsTransparentable() && globalTransparent!=0xff);
+  //the senders of the ops in this frame stop waiting
+  for (const auto& layer : _layers) {
+    if (layer->FinishQueuedOps()) {
+      InterruptGuard guard;
+      WakeKey(kLayerWaitKey | layer->ID(), kWakeAll);
+    }
   }
-  _screen->Copy({0 ,0}, _back_buffer, {{0 ,0},ScreenSize()});
+  RecordInputLatency();
 }
 
 void LayerManager::Move(unsigned int id, Vector2D<int> pos){
@@ -167,16 +345,13 @@ void LayerManager::Move(unsigned int id, Vector2D<int> pos){
   const auto window_size = layer->GetWindow()->Size();
   const auto old_pos = layer->GetPosition();
   layer->Move(pos);
-  Draw({old_pos, window_size});
-  Draw(id);
+  AddDamage({old_pos, window_size});
+  AddDamage({pos, window_size});
 }
+
 void LayerManager::MoveRelative(unsigned int id, Vector2D<int> pos_delta){
   auto layer = FindLayer(id);
-  const auto window_size = layer->GetWindow()->Size();
-  const auto old_pos = layer->GetPosition();
-  layer->MoveRelative(pos_delta);
-  Draw({old_pos, window_size});
-  Draw(id);
+  Move(id, layer->GetPosition() + pos_delta);
 }
 
 void LayerManager::SetIndex(unsigned int id, int index){
@@ -273,6 +448,8 @@ namespace {
     }
 }
 LayerManager* layer_manager;
+CompositorStat compositor_stat{};
+bool occlusion_culling = true;
 
 
 ActiveLayer::ActiveLayer(LayerManager& manager):_manager{manager}{
@@ -306,7 +483,7 @@ void ActiveLayer::Activate(unsigned int layer_id){
 }
 
 ActiveLayer* active_layer;
-std::map<unsigned int, uint64_t>* layer_task_map;
+LayerTaskMap* layer_task_map;
  
 
 void InitializeLayer() {
@@ -375,7 +552,7 @@ void InitializeLayer() {
   layer_manager->SetIndex(bg_button_layer_id, 2);
 
    active_layer = new ActiveLayer{*layer_manager};
-   layer_task_map = new std::map<unsigned int, uint64_t>;
+   layer_task_map = new LayerTaskMap;
 }
 
 
@@ -391,30 +568,49 @@ void ProcessLayerMessage(const Message& msg){
           {msg_params.x, msg_params.y});
       break;
     case LayerOperation::Draw:
-      if(active_layer->GetActive() == msg_params.layer_id){
-        auto elapsed = LAPICTimerElapsed();
-        layer_manager->Draw(msg_params.layer_id);
-        elapsed = LAPICTimerElapsed() - elapsed;
-        Log(kDebug,"draw layer %u [%-8u]\n", msg_params.layer_id, elapsed);
-      }else{
-        layer_manager->Draw(msg_params.layer_id);
-      }
+      layer_manager->Draw(msg_params.layer_id);
       break;
     case LayerOperation::DrawArea:
-      if(active_layer->GetActive() == msg_params.layer_id){
-        auto elapsed = LAPICTimerElapsed();
-        layer_manager->Draw(msg_params.layer_id, 
-            {{msg_params.x, msg_params.y}, {msg_params.w, msg_params.h}});
-        elapsed = LAPICTimerElapsed() - elapsed;
-        Log(kDebug,"draw area layer %u [%08u]\n", msg_params.layer_id, elapsed);
-      }else{
-        layer_manager->Draw(msg_params.layer_id, 
-            {{msg_params.x, msg_params.y}, {msg_params.w, msg_params.h}});
-      }
+      layer_manager->Draw(msg_params.layer_id, 
+          {{msg_params.x, msg_params.y}, {msg_params.w, msg_params.h}});
     break;
     default:
       break;
   }
+
+  if (msg_params.ticket != 0) {
+    auto layer = layer_manager->FindLayer(msg_params.layer_id);
+    if (layer && layer_manager->FramePending()) {
+      //the sender waits until the frame shows its drawing
+      layer->QueueOps(msg_params.ticket);
+      return;
+    }
+    if (layer) {
+      layer->FinishOps(msg_params.ticket);
+    }
+    __asm__("cli");
+    WakeKey(kLayerWaitKey | msg_params.layer_id, kWakeAll);
+    __asm__("sti");
+  }
+}
+
+void SendLayerMessageAndWait(Task& task, Message msg) {
+  auto& params = msg.arg.layer;
+  __asm__("cli");
+  auto layer = layer_manager->FindLayer(params.layer_id);
+  if (layer == nullptr) {
+    __asm__("sti");
+    return;
+  }
+  params.ticket = layer->NewOpTicket();
+  task_manager->SendMessage(1, msg);
+
+  //a closed layer has nothing left to wait for
+  WaitOnKeyUntil(task, kLayerWaitKey | params.layer_id, [&params]() {
+    auto layer = layer_manager->FindLayer(params.layer_id);
+    return layer == nullptr || layer->OpsDone() >= params.ticket;
+  });
+  __asm__("sti");
 }
 
 Error CloseLayer(unsigned int layer_id){
@@ -435,4 +631,38 @@ Error CloseLayer(unsigned int layer_id){
   __asm__("sti");
 
   return MAKE_ERROR(Error::kSuccess);
-}
\ No newline at end of file
+}
+
+InputLatencyStat input_latency_stat{};
+uint64_t pending_input_ns = 0;
+
+namespace {
+  //interrupt time of the oldest input the next frame shows, 0 if none
+  uint64_t frame_input_ns = 0;
+
+  void RecordInputLatency() {
+    if (frame_input_ns == 0) {
+      return;
+    }
+    const auto latency = MonotonicNanoseconds() - frame_input_ns;
+    frame_input_ns = 0;
+
+    auto& stat = input_latency_stat;
+    stat.count++;
+    stat.sum_ns += latency;
+    stat.max_ns = std::max(stat.max_ns, latency);
+    size_t bucket = 0;
+    while (bucket + 1 < stat.histogram.size() && latency >= (1000000ul << bucket)) {
+      ++bucket;
+    }
+    stat.histogram[bucket]++;
+  }
+}
+
+void QueueInputLatency() {
+  InterruptGuard guard;
+  if (frame_input_ns == 0) {
+    frame_input_ns = pending_input_ns;
+  }
+  pending_input_ns = 0;
+}
@@ -1,15 +1,22 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <memory>
 #include <functional>
 #include <map>
 
 #include "window.hpp"
 #include "message.hpp"
+#include "slab.hpp"
+
+class Task;
 
 class Layer{
   public:
     Layer(unsigned int id = 0);
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
     unsigned int ID() const;
 
     Layer& SetWindow(const std::shared_ptr<Window>& window);
@@ -20,6 +27,9 @@ class Layer{
     bool IsDraggable() const;
     Layer& SetTransparentable(bool transparentable);
     bool IsTransparentable() const;
+    //every pixel of the window covers what is below it: no transparent
+    //color and no alpha blending under the current globalTransparent
+    bool IsOpaque() const;
 
     Layer& Move(Vector2D<int> pos);
     Layer& MoveRelative(Vector2D<int> pos_delta);
@@ -28,8 +38,18 @@ class Layer{
 
     Layer&  SetOnClick(std::function<void (uint8_t)> handler);
     void OnClick(uint8_t button_id);
+
+    //tickets of layer messages whose senders wait, handed out in order
+    unsigned int NewOpTicket() { return ++_op_tickets; }
+    unsigned int OpsDone() const { return _ops_done; }
+    void FinishOps(unsigned int ticket) { _ops_done = std::max(_ops_done, ticket); }
+    //ops processed but not on the screen until the next frame
+    void QueueOps(unsigned int ticket) { _ops_queued = std::max(_ops_queued, ticket); }
+    //returns true if queued ops were finished
+    bool FinishQueuedOps();
   private:
     unsigned int _id;
+    unsigned int _op_tickets{0}, _ops_queued{0}, _ops_done{0};
     Vector2D<int> _pos;
     std::shared_ptr<Window> _window;
     bool _draggable{false};
@@ -43,10 +63,22 @@ class LayerManager{
     Layer& NewLayer();
     void RemoveLayer(unsigned int id);
     
-    void Draw(const Rectangle<int>& area) const;
-    void Draw(unsigned int id) const;
-    void Draw(unsigned int id, Rectangle<int> area) const;
-    void Fresh() const;
+    //Draw and Move only add damage, the next frame composites it
+    void Draw(const Rectangle<int>& area);
+    void Draw(unsigned int id);
+    void Draw(unsigned int id, Rectangle<int> area);
+    void Fresh();
+
+    //marks an area of the screen to composite in the next frame
+    void AddDamage(Rectangle<int> area);
+    //composites the damage, each pixel once per frame. Layers under
+    //opaque ones are drawn only where they show
+    void Composite();
+    //from here on frames are composited when a kCompositorTimer timer of
+    //the task fires, at most kFramesPerSecond. Before, every damage is
+    //composited at once
+    void StartFrames(uint64_t task_id);
+    bool FramePending() const { return _frame_scheduled; }
 
     void Move(unsigned int id, Vector2D<int> pos);
     void MoveRelative(unsigned int id, Vector2D<int> pos_delta);
@@ -61,8 +93,16 @@ class LayerManager{
 
 
   private:
+    void MergeDamage(Rectangle<int> area);
+    void ScheduleFrame();
+
     FrameBuffer* _screen{nullptr};
-    mutable FrameBuffer _back_buffer{};
+    FrameBuffer _back_buffer{};
+    //disjoint rectangles in screen coordinates
+    std::vector<Rectangle<int>> _damage{};
+    uint64_t _frame_task_id{0};
+    bool _frame_scheduled{false};
+    unsigned long _last_frame{0};
     std::vector<std::unique_ptr<Layer>> _layers{};
     std::vector<Layer*> _layer_stack{};
     unsigned int _last_id{0};
@@ -70,6 +110,23 @@ class LayerManager{
 
 extern LayerManager* layer_manager;
 
+const int kFramesPerSecond = 60;
+//timer value of the frame timer
+const int kCompositorTimer = 2;
+
+struct CompositorStat {
+  uint64_t frames;
+  uint64_t rects;
+  uint64_t pixels;
+  //pixels layers drew, pixels above plus overdraw
+  uint64_t layer_pixels;
+  uint64_t composite_ns;
+};
+
+extern CompositorStat compositor_stat;
+//skip the parts of layers covered by opaque layers above
+extern bool occlusion_culling;
+
 class ActiveLayer {
  public:
   ActiveLayer(LayerManager& manager);
@@ -84,10 +141,14 @@ class ActiveLayer {
 };
 
 extern ActiveLayer* active_layer;
-extern std::map<unsigned int, uint64_t>* layer_task_map;
+using LayerTaskMap = std::map<unsigned int, uint64_t, std::less<unsigned int>,
+    SlabAllocator<std::pair<const unsigned int, uint64_t>>>;
+extern LayerTaskMap* layer_task_map;
 
 void InitializeLayer();
 void ProcessLayerMessage(const Message& msg);
+//sends the layer message and sleeps until the main task processed it
+void SendLayerMessageAndWait(Task& task, Message msg);
 
 constexpr Message MakeLayerMessage(
     uint64_t task_id, unsigned int layer_id,
@@ -102,4 +163,18 @@ constexpr Message MakeLayerMessage(
   return msg;
 }
 
-Error CloseLayer(unsigned int layer_id);
\ No newline at end of file
+Error CloseLayer(unsigned int layer_id);
+
+//input-to-photon latency of the mouse cursor: from the xHCI interrupt
+//that reported a move to the end of the frame that shows it
+struct InputLatencyStat {
+  uint64_t count, sum_ns, max_ns;
+  //bucket n: below 2^n ms, the last one also counts the slower ones
+  std::array<uint64_t, 8> histogram;
+};
+
+extern InputLatencyStat input_latency_stat;
+//interrupt time of input that is not drawn yet, 0 if none
+extern uint64_t pending_input_ns;
+//the cursor moved for the pending input, the next frame shows it
+void QueueInputLatency();
\ No newline at end of file
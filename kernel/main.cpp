@@ -32,7 +32,9 @@
 #include "task.hpp"
 #include "terminal.hpp"
 #include "fat.hpp"
+#include "page_cache.hpp"
 #include "syscall.hpp"
+#include "smp.hpp"
 #include "uefi.h"
 
 
@@ -61,13 +63,12 @@ int printk(const char* format, ...){
   result = vsprintf(s, format, ap);
   va_end(ap);
 
-  if(IsLAPICTimerInitialized()){
-    StartLAPICTimer();
+  if(profile_timing){
+    auto elapsed = MonotonicNanoseconds();
     console->PutString(s);
-    auto elapsed = LAPICTimerElapsed();
-    StopLAPICTimer();
+    elapsed = MonotonicNanoseconds() - elapsed;
 
-    sprintf(s, "[%9d]", elapsed);
+    sprintf(s, "[%9lu ns]", elapsed);
     console->PutString(s);
   }else{
     console->PutString(s);
@@ -165,22 +166,10 @@ void TaskB(uint64_t task_id, int64_t data) {
     msg.arg.layer.layer_id = task_b_window_layer_id;
     msg.arg.layer.op = LayerOperation::Draw;
     __asm__("cli");
-    task_manager->SendMessage(1, msg);
+    //the main task runs at least at our level until it drew the window
+    task_manager->LendPriority(&task, 1);
     __asm__("sti");
-
-    while(true){
-      __asm__("cli");
-      auto msg = task.ReceiveMessage();
-      if(!msg){
-        task.Sleep();
-        __asm__("sti");
-        continue;
-      }
-
-      if(msg->type == Message::kLayerOpsFinish){
-        break;
-      }
-    }
+    SendLayerMessageAndWait(task, msg);
 
   }
 }
@@ -297,19 +286,13 @@ void TaskWallclock(uint64_t task_id, int64_t data) {
       Timer{timer_manager->CurrentTick(), 1, task_id});
 
   while (true) {
-    __asm__("cli");
-    auto msg = task.ReceiveMessage();
-    if (!msg) {
-      task.Sleep();
-      __asm__("sti");
-      continue;
-    }
-    __asm__("sti");
-
-    if (msg->type == Message::kTimerTimeout) {
+    const auto msg = task.WaitMessage();
+    if (msg.type == Message::kTimerTimeout) {
       draw_current_time();
+      __asm__("cli");
       timer_manager->AddTimer(
-          Timer{msg->arg.timer.timeout + kTimerFreq, 1, task_id});
+          Timer{msg.arg.timer.timeout + kTimerFreq, 1, task_id});
+      __asm__("sti");
     }
   }
 }
@@ -357,6 +340,7 @@ extern "C" void KernelMainNewStack(
   InitializeInterrupt();
 
   fat32::Initialize(volume_image);
+  InitializePageCache();
   InitializeFont();
   InitializePCI();
 
@@ -395,6 +379,10 @@ extern "C" void KernelMainNewStack(
 
   InitializeTask();
   Task& main_task = task_manager->CurrentTask();
+  //drawing and input: 10 ms of each 60 Hz frame ahead of all other tasks
+  task_manager->SetDeadline(main_task.ID(), kTimerFreq / 100, kTimerFreq / 60);
+  layer_manager->StartFrames(main_task.ID());
+  InitializeSMP();
   // terminals = new std::map<uint64_t, Terminal*>;
 
   // for(int i=1;i<10;i++){
@@ -418,19 +406,26 @@ extern "C" void KernelMainNewStack(
     .InitContext(TaskWallclock, 0)
     .Wakeup();
 
+  boot_memory_stat = memory_manager->Stat();
+
   char conter_str[128];
+  //a frame alone does not update the counter, else every frame would
+  //damage the screen for the next one
+  bool draw_counter = true;
   //process message queue
   while(true){ 
-    __asm__("cli");
-    const auto tick = timer_manager->CurrentTick();
-    __asm__("sti");
+    if (draw_counter) {
+      __asm__("cli");
+      const auto tick = timer_manager->CurrentTick();
+      __asm__("sti");
 
-    sprintf(conter_str, "%010lu", tick);
-    // FillRectangle(*main_window->Writer(), {18, 44}, {8 * 10, 16}, kWindowBGColor);
-    // WriteString(*main_window->Writer(), {18, 44}, conter_str, kWindowFGColor);
-    FillRectangle(*main_window->InnerWriter(), {14, 19}, {8 * 10, 16}, kWindowBGColor);
-    WriteString(*main_window->InnerWriter(), {14, 19}, conter_str, kWindowFGColor);
-    layer_manager->Draw(main_window_layer_id);
+      sprintf(conter_str, "%010lu", tick);
+      // FillRectangle(*main_window->Writer(), {18, 44}, {8 * 10, 16}, kWindowBGColor);
+      // WriteString(*main_window->Writer(), {18, 44}, conter_str, kWindowFGColor);
+      FillRectangle(*main_window->InnerWriter(), {14, 19}, {8 * 10, 16}, kWindowBGColor);
+      WriteString(*main_window->InnerWriter(), {14, 19}, conter_str, kWindowFGColor);
+      layer_manager->Draw(main_window_layer_id);
+    }
 
     // __asm__("cli");
     // // if(!main_queue.HasFront()){
@@ -455,9 +450,15 @@ extern "C" void KernelMainNewStack(
     
     __asm__("sti");
 
+    draw_counter = !(msg->type == Message::kTimerTimeout &&
+                     msg->arg.timer.value == kCompositorTimer);
     switch (msg->type){
       case Message::kInterruptXHCI:
         usb::xhci::ProcessEvents();
+        //the events did not move the cursor
+        __asm__("cli");
+        pending_input_ns = 0;
+        __asm__("sti");
         break;
       case Message::kInterruptLAPICTimer:
         printk("Timer interrupt\n");
@@ -465,7 +466,9 @@ extern "C" void KernelMainNewStack(
       case Message::kTimerTimeout:
         // printk("Timer: timeout = %lu, value = %d\n",
         //     msg.arg.timer.timeout, msg.arg.timer.value);
-        if (msg->arg.timer.value == kTextboxCursorTimer) {
+        if (msg->arg.timer.value == kCompositorTimer) {
+          layer_manager->Composite();
+        } else if (msg->arg.timer.value == kTextboxCursorTimer) {
           __asm__("cli");
           timer_manager->AddTimer(
               Timer{msg->arg.timer.timeout + kTimer05Sec, kTextboxCursorTimer, 1});
@@ -517,7 +520,7 @@ extern "C" void KernelMainNewStack(
       case Message::kLayerOps:
         ProcessLayerMessage(*msg);
         __asm__("cli");
-        task_manager->SendMessage(msg->src_task_id, Message{Message::kLayerOpsFinish});
+        task_manager->ReturnPriority(msg->src_task_id);
         __asm__("sti");
         break;
       default:
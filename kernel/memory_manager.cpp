@@ -1,15 +1,134 @@
 #include "memory_manager.hpp"
 
+#include <algorithm>
 #include <bitset>
 
 #include "logger.hpp"
+#include "paging.hpp"
 #include "simpletest/test_memory.hpp"
 
+namespace {
+  //log2(kBitsPerMapLine)
+  const int kLineOrder = 6;
+  static_assert(BitmapMemoryManager::kBitsPerMapLine == (1 << kLineOrder));
+
+  constexpr int Log2(size_t v) {
+    int n = 0;
+    while (v > 1) {
+      v >>= 1;
+      n++;
+    }
+    return n;
+  }
+  const int kTreeHeight = Log2(BitmapMemoryManager::kMapLineCount);
+  static_assert((1ul << kTreeHeight) == BitmapMemoryManager::kMapLineCount);
+
+  //bits at positions aligned to 2^order in a map line
+  const BitmapMemoryManager::MapLineType kAlignedMask[kLineOrder + 1] = {
+    0xffff'ffff'ffff'fffful,
+    0x5555'5555'5555'5555ul,
+    0x1111'1111'1111'1111ul,
+    0x0101'0101'0101'0101ul,
+    0x0001'0001'0001'0001ul,
+    0x0000'0001'0000'0001ul,
+    0x0000'0000'0000'0001ul,
+  };
+
+  //tree value of a node whose frames are all free
+  uint8_t FullValue(int height) {
+    return kLineOrder + 1 + height;
+  }
+
+  int OrderOf(size_t num_frames) {
+    int order = 0;
+    while ((1ul << order) < num_frames) {
+      order++;
+    }
+    return order;
+  }
+
+  //number of consecutive set bits from bit 0
+  int CountTrailingOnes(BitmapMemoryManager::MapLineType bits) {
+    if(~bits == 0){
+      return BitmapMemoryManager::kBitsPerMapLine;
+    }
+    return __builtin_ctzl(~bits);
+  }
+
+  //bit i of the result is set if frames i .. i+2^order-1 are all free
+  BitmapMemoryManager::MapLineType FreeRuns(
+      BitmapMemoryManager::MapLineType free_bits, int order) {
+    for (int k = 0; k < order; k++) {
+      free_bits &= free_bits >> (1 << k);
+    }
+    return free_bits;
+  }
+}
+
 BitmapMemoryManager::BitmapMemoryManager()
-    : _alloc_map{},_range_start{FrameID{0}}, _range_end{FrameID{kFrameCount}}{
+    : _alloc_map{},_range_start{FrameID{0}}, _range_end{FrameID{kFrameCount}},
+      _buddy_tree{}{
+  UpdateBuddyTree(0, kMapLineCount - 1);
 }
 
 WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames){
+  switch(_policy){
+    case FrameAllocPolicy::kBuddy:
+      return AllocateBuddy(num_frames);
+    case FrameAllocPolicy::kNextFit:
+      return AllocateNextFit(num_frames);
+    default:
+      return AllocateFirstFit(num_frames);
+  }
+}
+
+Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames){
+  SetBits(start_frame, num_frames, false);
+  if(num_frames > 0){
+    UpdateBuddyTree(start_frame.ID() / kBitsPerMapLine,
+        (start_frame.ID() + num_frames - 1) / kBitsPerMapLine);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void BitmapMemoryManager::AddRef(FrameID start_frame){
+  _extra_refs[start_frame.ID()]++;
+}
+
+Error BitmapMemoryManager::Release(FrameID start_frame, size_t num_frames){
+  auto it = _extra_refs.find(start_frame.ID());
+  if(it == _extra_refs.end()){
+    return Free(start_frame, num_frames);
+  }
+
+  if(--it->second == 0){
+    _extra_refs.erase(it);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+size_t BitmapMemoryManager::RefCount(FrameID start_frame) const{
+  if(!GetBit(start_frame)){
+    return 0;
+  }
+  auto it = _extra_refs.find(start_frame.ID());
+  return it == _extra_refs.end() ? 1 : 1 + it->second;
+}
+
+void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames){
+  SetBits(start_frame, num_frames, true);
+  if(num_frames > 0){
+    UpdateBuddyTree(start_frame.ID() / kBitsPerMapLine,
+        (start_frame.ID() + num_frames - 1) / kBitsPerMapLine);
+  }
+}
+void BitmapMemoryManager::SetMemoryRange(FrameID start_frame, FrameID end_frame){
+  _range_start = start_frame;
+  _range_end = end_frame;
+  UpdateBuddyTree(0, kMapLineCount - 1);
+}
+
+WithError<FrameID> BitmapMemoryManager::AllocateFirstFit(size_t num_frames){
   size_t start_frame_id = _range_start.ID();
   while(start_frame_id < _range_end.ID()){
     size_t i = 0;
@@ -34,21 +153,162 @@ WithError<FrameID> BitmapMemoryManager::Allocate(size_t num_frames){
   return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
 }
 
-Error BitmapMemoryManager::Free(FrameID start_frame, size_t num_frames){
-  for(size_t i = 0; i < num_frames; i++){
-    SetBit(FrameID{start_frame.ID() + i}, false);
+WithError<FrameID> BitmapMemoryManager::AllocateBuddy(size_t num_frames){
+  const int order = OrderOf(num_frames);
+  if(order > kLineOrder + kTreeHeight || _buddy_tree[1] < order + 1){
+    //no aligned block is large enough, an unaligned run may still fit
+    const auto frame = FindFreeRun(num_frames, _range_start.ID());
+    if(frame.ID() == kNullFrame.ID()){
+      return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
+    }
+    MarkAllocated(frame, num_frames);
+    return { frame, MAKE_ERROR(Error::kSuccess) };
   }
-  return MAKE_ERROR(Error::kSuccess);
+
+  //descend to the leftmost node holding a free block of 2^order frames
+  const int target_height = std::max(order - kLineOrder, 0);
+  size_t node = 1;
+  for(int height = kTreeHeight; height > target_height; height--){
+    node *= 2;
+    if(_buddy_tree[node] < order + 1){
+      node++;
+    }
+  }
+
+  const size_t level_first = 1ul << (kTreeHeight - target_height);
+  size_t start_frame_id = (node - level_first) * kBitsPerMapLine << target_height;
+  if(order < kLineOrder){
+    const auto runs = FreeRuns(FreeBits(node - level_first), order) & kAlignedMask[order];
+    start_frame_id += __builtin_ctzl(runs);
+  }
+
+  MarkAllocated(FrameID{start_frame_id}, num_frames);
+  return { FrameID{start_frame_id}, MAKE_ERROR(Error::kSuccess) };
 }
 
-void BitmapMemoryManager::MarkAllocated(FrameID start_frame, size_t num_frames){
-  for(size_t i = 0; i < num_frames; i++){
-    SetBit(FrameID{start_frame.ID() + i}, true);
+WithError<FrameID> BitmapMemoryManager::AllocateNextFit(size_t num_frames){
+  auto frame = FindFreeRun(num_frames, std::max(_next_fit, _range_start.ID()));
+  if(frame.ID() == kNullFrame.ID()){
+    //wrap around
+    frame = FindFreeRun(num_frames, _range_start.ID());
+  }
+  if(frame.ID() == kNullFrame.ID()){
+    return {kNullFrame, MAKE_ERROR(Error::kNoEnoughMemory)};
   }
+
+  MarkAllocated(frame, num_frames);
+  _next_fit = frame.ID() + num_frames;
+  return { frame, MAKE_ERROR(Error::kSuccess) };
 }
-void BitmapMemoryManager::SetMemoryRange(FrameID start_frame, FrameID end_frame){
-  _range_start = start_frame;
-  _range_end = end_frame;
+
+FrameID BitmapMemoryManager::FindFreeRun(size_t num_frames, size_t from_frame) const {
+  if(num_frames == 0 || from_frame >= _range_end.ID()){
+    return kNullFrame;
+  }
+
+  size_t run_start = 0;
+  size_t run_len = 0;
+  const size_t last_line = (_range_end.ID() - 1) / kBitsPerMapLine;
+  for(size_t line = from_frame / kBitsPerMapLine; line <= last_line; line++){
+    const size_t line_start = line * kBitsPerMapLine;
+    MapLineType free_bits = FreeBits(line);
+    if(from_frame > line_start){
+      free_bits &= ~static_cast<MapLineType>(0) << (from_frame - line_start);
+    }
+
+    if(free_bits == 0){
+      //whole line allocated
+      run_len = 0;
+      continue;
+    }
+
+    if(run_len > 0){
+      //continue the run from the previous line
+      const size_t ones = CountTrailingOnes(free_bits);
+      run_len += ones;
+      if(run_len >= num_frames){
+        return FrameID{run_start};
+      }
+      if(ones == kBitsPerMapLine){
+        continue;
+      }
+      run_len = 0;
+      free_bits &= ~((static_cast<MapLineType>(1) << ones) - 1);
+    }
+
+    while(free_bits != 0){
+      const size_t pos = __builtin_ctzl(free_bits);
+      const size_t ones = CountTrailingOnes(free_bits >> pos);
+      if(ones >= num_frames){
+        return FrameID{line_start + pos};
+      }
+      if(pos + ones == kBitsPerMapLine){
+        //run reaches the end of this line
+        run_start = line_start + pos;
+        run_len = ones;
+        break;
+      }
+      free_bits &= ~(((static_cast<MapLineType>(1) << ones) - 1) << pos);
+    }
+  }
+  return kNullFrame;
+}
+
+BitmapMemoryManager::MapLineType BitmapMemoryManager::FreeBits(size_t line_index) const {
+  const size_t line_start = line_index * kBitsPerMapLine;
+  const size_t line_end = line_start + kBitsPerMapLine;
+  if(line_end <= _range_start.ID() || _range_end.ID() <= line_start){
+    return 0;
+  }
+
+  MapLineType free_bits = ~_alloc_map[line_index];
+  if(_range_start.ID() > line_start){
+    free_bits &= ~static_cast<MapLineType>(0) << (_range_start.ID() - line_start);
+  }
+  if(_range_end.ID() < line_end){
+    free_bits &= (static_cast<MapLineType>(1) << (_range_end.ID() - line_start)) - 1;
+  }
+  return free_bits;
+}
+
+uint8_t BitmapMemoryManager::LineBuddyValue(size_t line_index) const {
+  MapLineType free_bits = FreeBits(line_index);
+  uint8_t value = 0;
+  for(int order = 0; order <= kLineOrder; order++){
+    if((free_bits & kAlignedMask[order]) == 0){
+      break;
+    }
+    value = order + 1;
+    if(order < kLineOrder){
+      free_bits &= free_bits >> (1 << order);
+    }
+  }
+  return value;
+}
+
+void BitmapMemoryManager::UpdateBuddyTree(size_t first_line, size_t last_line){
+  last_line = std::min(last_line, kMapLineCount - 1);
+  for(size_t i = first_line; i <= last_line; i++){
+    _buddy_tree[kMapLineCount + i] = LineBuddyValue(i);
+  }
+
+  //merge buddies up to the root
+  size_t first = (kMapLineCount + first_line) / 2;
+  size_t last = (kMapLineCount + last_line) / 2;
+  for(int height = 1; first >= 1; height++){
+    const auto child_full = FullValue(height - 1);
+    for(size_t node = first; node <= last; node++){
+      const auto left = _buddy_tree[2 * node];
+      const auto right = _buddy_tree[2 * node + 1];
+      if(left == child_full && right == child_full){
+        _buddy_tree[node] = child_full + 1;
+      }else{
+        _buddy_tree[node] = std::max(left, right);
+      }
+    }
+    first /= 2;
+    last /= 2;
+  }
 }
 
 MemoryStat BitmapMemoryManager::Stat() const {
@@ -67,6 +327,27 @@ bool BitmapMemoryManager::GetBit(FrameID frame) const{
   return (_alloc_map[line_index] & (static_cast<MapLineType>(0x1) << bit_index)) != 0 ;
 }
 
+void BitmapMemoryManager::SetBits(FrameID start_frame, size_t num_frames, bool allocated){
+  size_t frame = start_frame.ID();
+  const size_t end_frame = frame + num_frames;
+  while(frame < end_frame){
+    const auto line_index = frame / kBitsPerMapLine;
+    const auto bit_index = frame % kBitsPerMapLine;
+    const auto num_bits = std::min(kBitsPerMapLine - bit_index, end_frame - frame);
+
+    MapLineType mask = ~static_cast<MapLineType>(0);
+    if(num_bits < kBitsPerMapLine){
+      mask = ((static_cast<MapLineType>(1) << num_bits) - 1) << bit_index;
+    }
+    if(allocated){
+      _alloc_map[line_index] |= mask;
+    }else{
+      _alloc_map[line_index] &= ~mask;
+    }
+    frame += num_bits;
+  }
+}
+
 void BitmapMemoryManager::SetBit(FrameID frame, bool allocated){
   auto line_index = frame.ID() / kBitsPerMapLine;
   auto bit_index = frame.ID() % kBitsPerMapLine;
@@ -84,22 +365,69 @@ namespace {
   char memory_manager_buf[sizeof(BitmapMemoryManager)];
 
 
-  Error InitializeHeap(BitmapMemoryManager& memory_manager){
-    //64*2M = 128M
-    const int kHeapFrames = 64 * 512;
-    const auto heap_start = memory_manager.Allocate(kHeapFrames);
-    if(heap_start.error){
-      return heap_start.error;
+  //heap is mapped in chunks, a mapped tail beyond kHeapTrimBytes is returned
+  const size_t kHeapGrowBytes = 64 * kBytesPerFrame;
+  const size_t kHeapTrimBytes = 256 * kBytesPerFrame;
+  size_t heap_peak_bytes = 0;
+
+  uintptr_t RoundUpFrame(uintptr_t addr) {
+    return (addr + kBytesPerFrame - 1) & ~static_cast<uintptr_t>(kBytesPerFrame - 1);
+  }
+
+  Error InitializeHeap(){
+    program_break = reinterpret_cast<caddr_t>(kKernelHeapBase);
+    program_break_end = program_break;
+    if(auto err = MapKernelPages(kKernelHeapBase, kHeapGrowBytes / kBytesPerFrame)){
+      return err;
     }
+    program_break_end += kHeapGrowBytes;
 
-    program_break = reinterpret_cast<caddr_t>(heap_start.value.ID() * kBytesPerFrame);
-    program_break_end = program_break + kHeapFrames * kBytesPerFrame;
-    
     Log(kDebug, "heap addr:%08lx - %08lx\n",program_break,program_break_end);
     return MAKE_ERROR(Error::kSuccess);
   }
 }
 
+extern "C" int ResizeHeap(caddr_t new_break) {
+  const auto heap_base = kKernelHeapBase;
+  const auto brk = reinterpret_cast<uintptr_t>(new_break);
+  if (brk < heap_base || brk > heap_base + kKernelHeapMaxBytes) {
+    return -1;
+  }
+
+  const auto mapped_end = reinterpret_cast<uintptr_t>(program_break_end);
+  const auto needed_end = RoundUpFrame(brk);
+  if (needed_end > mapped_end) {
+    const auto grow_end = std::min<uintptr_t>(
+        std::max(needed_end, mapped_end + kHeapGrowBytes),
+        heap_base + kKernelHeapMaxBytes);
+    if (MapKernelPages(mapped_end, (grow_end - mapped_end) / kBytesPerFrame)) {
+      //called from inside malloc, so no logging here.
+      //pages mapped so far are reused by the next grow
+      return -1;
+    }
+    program_break_end = reinterpret_cast<caddr_t>(grow_end);
+  } else if (mapped_end - needed_end > kHeapTrimBytes) {
+    const auto keep_end = needed_end + kHeapGrowBytes;
+    UnmapKernelPages(keep_end, (mapped_end - keep_end) / kBytesPerFrame);
+    program_break_end = reinterpret_cast<caddr_t>(keep_end);
+  }
+
+  heap_peak_bytes = std::max<size_t>(heap_peak_bytes, brk - heap_base);
+  return 0;
+}
+
+HeapStat KernelHeapStat() {
+  const auto heap_base = reinterpret_cast<caddr_t>(kKernelHeapBase);
+  return {
+    static_cast<size_t>(program_break_end - heap_base),
+    static_cast<size_t>(program_break - heap_base),
+    heap_peak_bytes,
+  };
+}
+
+MemoryStat boot_memory_stat{0, 0};
+FrameID ap_boot_frame{kNullFrame};
+
 BitmapMemoryManager* memory_manager;
 
 void InitializeMemoryManager(const MemoryMap& memory_map) {
@@ -130,6 +458,13 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
         (desc->physical_start-available_end)/kBytesPerFrame);
       }
       available_end = physical_end;
+
+      //a SIPI can only start an AP in the first 1MiB, frame 0 is never used
+      const auto low_start = std::max<uintptr_t>(desc->physical_start, kBytesPerFrame);
+      if(ap_boot_frame.ID() == kNullFrame.ID() &&
+         low_start < std::min<uintptr_t>(physical_end, 0x100000)){
+        ap_boot_frame = FrameID{low_start / kBytesPerFrame};
+      }
     }else{
       memory_manager->MarkAllocated(FrameID{available_end/kBytesPerFrame}, 
       (physical_end - available_end)/kBytesPerFrame);
@@ -137,9 +472,12 @@ void InitializeMemoryManager(const MemoryMap& memory_map) {
   }
   
   memory_manager->SetMemoryRange(FrameID{1}, FrameID{available_end/kBytesPerFrame});
+  if(ap_boot_frame.ID() != kNullFrame.ID()){
+    memory_manager->MarkAllocated(ap_boot_frame, 1);
+  }
   Log(kDebug,"total memory frame:%d\n",available_end/kBytesPerFrame);
 
-  if(auto err = InitializeHeap(*memory_manager)){
+  if(auto err = InitializeHeap()){
     Log(kError, err, "failed to allocate pages: %s at %s:%d\n",
         err.Name());
     while (1) __asm__("hlt");
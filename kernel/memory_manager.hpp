@@ -2,6 +2,7 @@
 
 #include <cstdio>
 #include <limits>
+#include <map>
 
 #include "error.hpp"
 #include "memory_map.hpp"
@@ -39,30 +40,84 @@ struct MemoryStat {
   size_t total_frames;
 };
 
+enum class FrameAllocPolicy {
+  //scan the bitmap frame by frame from _range_start
+  kFirstFit,
+  //search the buddy tree for a free power-of-two block
+  kBuddy,
+  //scan the bitmap word by word from where the last allocation ended
+  kNextFit,
+};
+
 class BitmapMemoryManager{
   public:
    using MapLineType = unsigned long;
     static const auto kMaxPhysicalMemoryBytes{128_GiB};
     static const auto kFrameCount{kMaxPhysicalMemoryBytes / kBytesPerFrame};
     static const size_t kBitsPerMapLine{8 * sizeof(MapLineType)};
+    static const size_t kMapLineCount{kFrameCount / kBitsPerMapLine};
     
     BitmapMemoryManager();
     WithError<FrameID> Allocate(size_t num_frames);
     Error Free(FrameID start_frame, size_t num_frames);
 
+    //an allocated run holds one reference, shared runs are counted by
+    //their first frame
+    void AddRef(FrameID start_frame);
+    //drops one reference and frees the run with the last one
+    Error Release(FrameID start_frame, size_t num_frames = 1);
+    size_t RefCount(FrameID start_frame) const;
+
     void MarkAllocated(FrameID start_frame, size_t num_frames);
     void SetMemoryRange(FrameID start_frame, FrameID end_frame);
 
     MemoryStat Stat() const;
+
+    void SetPolicy(FrameAllocPolicy policy) { _policy = policy; }
+    FrameAllocPolicy Policy() const { return _policy; }
     
   private:
-    std::array<MapLineType, kFrameCount / kBitsPerMapLine> _alloc_map;
+    std::array<MapLineType, kMapLineCount> _alloc_map;
     FrameID _range_start;
     FrameID _range_end;
+    FrameAllocPolicy _policy{FrameAllocPolicy::kBuddy};
+    size_t _next_fit{0};
+    //references beyond the first, only shared runs have an entry
+    std::map<size_t, size_t> _extra_refs{};
+
+    /*
+     * buddy tree over map lines (heap layout, root = 1, leaf of line i = kMapLineCount + i).
+     * value 0: no free frame, value v: largest free aligned block is 2^(v-1) frames.
+     */
+    std::array<uint8_t, 2 * kMapLineCount> _buddy_tree;
+
+    WithError<FrameID> AllocateFirstFit(size_t num_frames);
+    WithError<FrameID> AllocateBuddy(size_t num_frames);
+    WithError<FrameID> AllocateNextFit(size_t num_frames);
+    //lowest free run of num_frames at or after from_frame, kNullFrame if none
+    FrameID FindFreeRun(size_t num_frames, size_t from_frame) const;
+    //free frames of a map line, frames out of the memory range count as allocated
+    MapLineType FreeBits(size_t line_index) const;
+    uint8_t LineBuddyValue(size_t line_index) const;
+    void UpdateBuddyTree(size_t first_line, size_t last_line);
 
     bool GetBit(FrameID frame) const;
     void SetBit(FrameID frame, bool allocated);
+    void SetBits(FrameID start_frame, size_t num_frames, bool allocated);
 };
 
 extern BitmapMemoryManager* memory_manager;
+
+struct HeapStat {
+  size_t mapped_bytes;
+  size_t used_bytes;
+  size_t peak_bytes;
+};
+
+HeapStat KernelHeapStat();
+//frame usage right after boot, recorded by KernelMain
+extern MemoryStat boot_memory_stat;
+//free frame below 1MiB kept for the AP startup code, kNullFrame if none
+extern FrameID ap_boot_frame;
+
 void InitializeMemoryManager(const MemoryMap& memory_map);
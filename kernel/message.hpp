@@ -15,12 +15,11 @@ struct Message{
     kTimerTimeout,
     kKeyPush,
     kLayerOps,
-    kLayerOpsFinish,
     kMouseMove,
     kMouseButton,
     kWindowActive,
-    kPipe,
     kWindowClose,
+    kPingPong,
   } type;
 
   uint64_t src_task_id;
@@ -43,6 +42,9 @@ struct Message{
       unsigned int layer_id;
       int x, y;
       int w, h;
+      //not 0: the sender waits in SendLayerMessageAndWait until
+      //ProcessLayerMessage or LayerManager::Composite finishes this op
+      unsigned int ticket;
     } layer;
 
     struct{
@@ -63,13 +65,13 @@ struct Message{
       int activate; 
     } window_active;
 
-    struct{
-      char data[16];
-      uint8_t len;
-    } pipe;
-    
     struct {
       unsigned int layer_id;
     } window_close;
+
+    struct {
+      // 1: stop the peer
+      int stop;
+    } ping_pong;
   } arg;
 };
@@ -106,16 +106,18 @@ namespace{
   
 void DrawMouseCursor(PixelWriter * pixel_writer, Vector2D<int> position){
   //draw mouse cursor
+  PixelColor row[kMouseCursorWidth];
   for(int dy = 0; dy< kMouseCursorHeight; dy++){
     for(int dx = 0; dx < kMouseCursorWidth; dx++){
       if(mouse_cursor_shape[dy][dx] == '@'){
-        pixel_writer->Write(Vector2D<int>{position.x + dx, position.y + dy}, {0, 0, 0});
+        row[dx] = {0, 0, 0};
       }else if(mouse_cursor_shape[dy][dx] == '.'){
-        pixel_writer->Write(Vector2D<int>{position.x + dx, position.y + dy}, {255, 255, 255});
+        row[dx] = {255, 255, 255};
       } else {
-        pixel_writer->Write(Vector2D<int>{position.x + dx, position.y + dy}, kMouseTransparentColor);
+        row[dx] = kMouseTransparentColor;
       }
     }
+    pixel_writer->BlitSpan(Vector2D<int>{position.x, position.y + dy}, row, kMouseCursorWidth);
   }
 }
 
@@ -141,16 +143,16 @@ void MouseCursor::OnInterrupt(uint8_t buttons, int8_t displacement_x, int8_t dis
     
     const auto posdiff = _position - oldpos;
 
-    if(IsLAPICTimerInitialized()){
-      StartLAPICTimer();
+    if(profile_timing){
+      auto elapsed = MonotonicNanoseconds();
       layer_manager->Move(_layer_id, _position);
       // layer_manager->Draw();
-      auto elapsed = LAPICTimerElapsed();
-      StopLAPICTimer();
-      Log(kDebug, "MouseObserver: elapsed = %u\n", elapsed);
+      elapsed = MonotonicNanoseconds() - elapsed;
+      Log(kDebug, "MouseObserver: elapsed = %lu ns\n", elapsed);
     }else{
       layer_manager->Move(_layer_id, _position);
     }
+    QueueInputLatency();
 
     unsigned int close_layer_id = 0;
 
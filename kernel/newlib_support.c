@@ -2,8 +2,11 @@
 #include <errno.h>
 
 caddr_t program_break = 0, program_break_end = 0;
+//maps or unmaps heap frames so that the heap ends at new_break
+int ResizeHeap(caddr_t new_break);
+
 caddr_t sbrk(int incr){
-  if(program_break == 0 || program_break + incr >= program_break_end){
+  if(program_break == 0 || ResizeHeap(program_break + incr) != 0){
     errno = ENOMEM;
     return (caddr_t)-1;
   }
@@ -0,0 +1,65 @@
+#include "page_cache.hpp"
+
+#include "paging.hpp"
+#include "memory_manager.hpp"
+
+WithError<void*> PageCache::GetPage(::FileDescriptor& fd,
+    const fat32::DirectoryEntry& entry, size_t page_index) {
+  const Key key{&entry, page_index};
+  if (auto it = _pages.find(key); it != _pages.end()) {
+    _hits++;
+    return { it->second, MAKE_ERROR(Error::kSuccess) };
+  }
+
+  _misses++;
+  if (_pages.size() >= kMaxPages) {
+    EvictUnmapped();
+  }
+  if (_pages.size() >= kMaxPages) {
+    return { nullptr, MAKE_ERROR(Error::kFull) };
+  }
+
+  //zero cleared, so the tail after the end of file reads as 0
+  auto [page, err] = NewPageMap();
+  if (err) {
+    return { nullptr, err };
+  }
+  fd.Load(page, 4096, page_index * 4096);
+  _pages.insert(std::make_pair(key, page));
+  return { page, MAKE_ERROR(Error::kSuccess) };
+}
+
+void PageCache::Invalidate(const fat32::DirectoryEntry& entry) {
+  auto it = _pages.lower_bound(Key{&entry, 0});
+  while (it != _pages.end() && it->first.first == &entry) {
+    //apps still mapping the page keep it alive
+    ReleasePage(it->second);
+    it = _pages.erase(it);
+  }
+}
+
+void PageCache::EvictUnmapped() {
+  for (auto it = _pages.begin(); it != _pages.end();) {
+    const FrameID frame{reinterpret_cast<uintptr_t>(it->second) / kBytesPerFrame};
+    if (memory_manager->RefCount(frame) == 1) {
+      ReleasePage(it->second);
+      it = _pages.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void PageCache::ReleasePage(void* page) {
+  memory_manager->Release(FrameID{reinterpret_cast<uintptr_t>(page) / kBytesPerFrame});
+}
+
+PageCacheStat PageCache::Stat() const {
+  return { _pages.size(), _hits, _misses };
+}
+
+PageCache* page_cache;
+
+void InitializePageCache() {
+  page_cache = new PageCache;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <utility>
+
+#include "error.hpp"
+#include "fat.hpp"
+
+struct PageCacheStat {
+  size_t cached_pages;
+  size_t hits;
+  size_t misses;
+};
+
+/*
+ * file pages shared by every task mapping the same file,
+ * keyed by (directory entry, page index).
+ */
+class PageCache {
+  public:
+    static const size_t kMaxPages = 4096;
+
+    //returns the cached page, loading it through fd on a miss. the cache
+    //holds one reference of the frame, each mapping adds one.
+    //kFull when every cached page is mapped, callers use a private page then
+    WithError<void*> GetPage(::FileDescriptor& fd, const fat32::DirectoryEntry& entry,
+                             size_t page_index);
+    //forget pages of a file that is written or deleted
+    void Invalidate(const fat32::DirectoryEntry& entry);
+    PageCacheStat Stat() const;
+
+  private:
+    using Key = std::pair<const fat32::DirectoryEntry*, size_t>;
+    std::map<Key, void*> _pages{};
+    size_t _hits{0}, _misses{0};
+
+    //drops pages no app maps any more
+    void EvictUnmapped();
+    void ReleasePage(void* page);
+};
+
+extern PageCache* page_cache;
+
+void InitializePageCache();
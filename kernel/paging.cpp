@@ -1,12 +1,16 @@
 #include "paging.hpp"
 
+#include <algorithm>
 #include <array>
+#include <bitset>
 #include <cstring>
 
 #include "asmfunc.h"
 #include "task.hpp"
 #include "memory_manager.hpp"
 #include "logger.hpp"
+#include "page_cache.hpp"
+#include "smp.hpp"
 
 namespace{
   const uint64_t kPageSize4K = 4096;
@@ -17,7 +21,31 @@ namespace{
   alignas(kPageSize4K) std::array<uint64_t, 512> pdp_table;
   alignas(kPageSize4K) 
   std::array<std::array<uint64_t, 512>, kPageDirectoryCount> page_directory;
+  alignas(kPageSize4K) std::array<uint64_t, 512> heap_pdp_table;
 }
+
+PagingStat paging_stat{0, 0, 0, 0, 0};
+bool huge_page_enabled = true;
+
+namespace {
+  const size_t kPCIDCount = 4096;
+  bool pcid_enabled = false;
+  std::bitset<kPCIDCount> pcid_used{1};
+  //per CPU: TLB entries tagged with the PCID match the current page tables
+  std::array<std::bitset<kPCIDCount>, kMaxCPUs> pcid_fresh{};
+  size_t next_pcid = 1;
+  //bumped when kernel heap pages are unmapped, CPUs that saw an older
+  //value may still cache them
+  unsigned long kernel_tlb_gen = 0;
+  std::array<unsigned long, kMaxCPUs> cpu_tlb_gen{};
+
+  void ClearFreshPCID(size_t pcid) {
+    for (auto& fresh : pcid_fresh) {
+      fresh[pcid] = false;
+    }
+  }
+}
+
 void SetupIdentityPageTable(){
   pml4_table[0] = reinterpret_cast<uint64_t>(&pdp_table[0]) | 0x3;
   for(int i_pdpt = 0; i_pdpt < page_directory.size(); i_pdpt++){
@@ -26,6 +54,9 @@ void SetupIdentityPageTable(){
       page_directory[i_pdpt][i_pd] = i_pdpt * kPageSize1G + i_pd * kPageSize2M | 0x83;
     }
   }
+  //filled on demand by MapKernelPages, app pml4s copy this entry
+  pml4_table[LinearAddress4Level{kKernelHeapBase}.parts.pml4] =
+      reinterpret_cast<uint64_t>(&heap_pdp_table[0]) | 0x3;
 
   ResetCR3();
   // Clear WP
@@ -35,6 +66,74 @@ void SetupIdentityPageTable(){
 void InitializePaging() {
   //init manage memory(paging)
   SetupIdentityPageTable();
+
+  //CPUID.01H:ECX.PCID[bit 17], CR4.PCIDE[bit 17]
+  uint32_t regs[4];
+  CPUID(1, 0, regs);
+  if (regs[2] & (1u << 17)) {
+    SetCR4(GetCR4() | (1u << 17));
+    pcid_enabled = true;
+  }
+  Log(kDebug, "PCID: %s\n", pcid_enabled ? "enabled" : "unsupported");
+}
+
+PageMapEntry* CurrentPML4() {
+  return reinterpret_cast<PageMapEntry*>(GetCR3() & ~kCR3PCIDMask);
+}
+
+uint64_t AllocatePCID() {
+  if (!pcid_enabled) {
+    return 0;
+  }
+  for (size_t i = 0; i < kPCIDCount - 1; i++) {
+    const auto pcid = next_pcid;
+    next_pcid = next_pcid % (kPCIDCount - 1) + 1;
+    if (!pcid_used[pcid]) {
+      pcid_used[pcid] = true;
+      ClearFreshPCID(pcid);
+      return pcid;
+    }
+  }
+  return 0;
+}
+
+void FreePCID(uint64_t pcid) {
+  if (pcid != 0) {
+    pcid_used[pcid] = false;
+    ClearFreshPCID(pcid);
+  }
+}
+
+uint64_t CR3ForSwitch(uint64_t cr3) {
+  cr3 &= ~kCR3NoFlush;
+  const auto pcid = cr3 & kCR3PCIDMask;
+  if (!pcid_enabled || pcid == 0) {
+    return cr3;
+  }
+  auto& fresh = pcid_fresh[CurrentCPU()];
+  if (fresh[pcid]) {
+    return cr3 | kCR3NoFlush;
+  }
+  //this load flushes the PCID
+  fresh[pcid] = true;
+  return cr3;
+}
+
+void ForgetPCID(uint64_t cr3, int cpu) {
+  const auto pcid = cr3 & kCR3PCIDMask;
+  if (pcid != 0) {
+    pcid_fresh[cpu][pcid] = false;
+  }
+}
+
+void SyncKernelTLB() {
+  const int cpu = CurrentCPU();
+  if (cpu_tlb_gen[cpu] == kernel_tlb_gen) {
+    return;
+  }
+  cpu_tlb_gen[cpu] = kernel_tlb_gen;
+  pcid_fresh[cpu].reset();
+  SetCR3(GetCR3() & ~kCR3NoFlush);
 }
 
 void ResetCR3() {
@@ -61,30 +160,88 @@ namespace {
     return { child_map, MAKE_ERROR(Error::kSuccess) };
   }
 
+  const size_t kPagesPerHugePage = kPageSize2M / kPageSize4K;
+
+  //2MiB aligned frames, fails if the allocator returns an unaligned block
+  WithError<PageMapEntry*> NewHugePage() {
+    auto frame = memory_manager->Allocate(kPagesPerHugePage);
+    if (frame.error) {
+      return { nullptr, frame.error };
+    }
+    if (frame.value.ID() % kPagesPerHugePage != 0) {
+      memory_manager->Free(frame.value, kPagesPerHugePage);
+      return { nullptr, MAKE_ERROR(Error::kNoEnoughMemory) };
+    }
+    return { reinterpret_cast<PageMapEntry*>(frame.value.Frame()),
+             MAKE_ERROR(Error::kSuccess) };
+  }
+
+  //maps the 2MiB region at addr with one huge page when possible.
+  //returns the number of 4KiB pages covered, 0 to fall back to 4KiB pages
+  size_t SetupHugePage(PageMapEntry& entry, LinearAddress4Level addr,
+      size_t num_4kpages, bool writable) {
+    if (entry.bits.present) {
+      if (!entry.bits.huge_page) {
+        return 0;
+      }
+      entry.bits.writable |= writable;
+      return std::min(num_4kpages, kPagesPerHugePage - addr.Part(1));
+    }
+
+    if (!huge_page_enabled || addr.Part(1) != 0 || num_4kpages < kPagesPerHugePage) {
+      return 0;
+    }
+
+    auto [page, err] = NewHugePage();
+    if (err) {
+      return 0;
+    }
+    memset(page, 0, kPageSize2M);
+
+    entry.data = 0;
+    entry.SetPointer(page);
+    entry.bits.present = 1;
+    entry.bits.huge_page = 1;
+    entry.bits.user = 1;
+    entry.bits.writable = writable;
+    paging_stat.mapped_2m_pages++;
+    return kPagesPerHugePage;
+  }
+
   WithError<size_t> SetupPageMap(PageMapEntry* page_map, int page_map_level,
       LinearAddress4Level addr, size_t num_4kpages, bool writable) {
     while(num_4kpages > 0){
       const auto entry_index = addr.Part(page_map_level);
 
-      auto [child_map, err] = SetNewPageMapIfNotPresent(page_map[entry_index]);
-      if(err){
-        return { num_4kpages, err };
+      size_t huge_pages = 0;
+      if(page_map_level == 2){
+        huge_pages = SetupHugePage(page_map[entry_index], addr, num_4kpages, writable);
       }
-      
-      //ring3
-      page_map[entry_index].bits.user = 1;
 
-      if(page_map_level == 1){
-        page_map[entry_index].bits.writable = writable;
-        num_4kpages--;
+      if(huge_pages > 0){
+        num_4kpages -= huge_pages;
       }else{
-        page_map[entry_index].bits.writable = true;
-        auto [num_remain_pages, err] =
-            SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable);
+        auto [child_map, err] = SetNewPageMapIfNotPresent(page_map[entry_index]);
         if(err){
           return { num_4kpages, err };
         }
-        num_4kpages = num_remain_pages;
+
+        //ring3
+        page_map[entry_index].bits.user = 1;
+
+        if(page_map_level == 1){
+          page_map[entry_index].bits.writable = writable;
+          num_4kpages--;
+          paging_stat.mapped_4k_pages++;
+        }else{
+          page_map[entry_index].bits.writable = true;
+          auto [num_remain_pages, err] =
+              SetupPageMap(child_map, page_map_level - 1, addr, num_4kpages, writable);
+          if(err){
+            return { num_4kpages, err };
+          }
+          num_4kpages = num_remain_pages;
+        }
       }
 
       if(entry_index == 511){
@@ -100,24 +257,30 @@ namespace {
     return { num_4kpages, MAKE_ERROR(Error::kSuccess) };
   }
 
+  FrameID FrameOf(const PageMapEntry& entry) {
+    return FrameID{reinterpret_cast<uintptr_t>(entry.Pointer()) / kBytesPerFrame};
+  }
+
+  //page tables are private to their pml4, pages drop one reference
   Error CleanPageMap(PageMapEntry* page_map, int page_map_level,
-      LinearAddress4Level addr,bool clean_readonly = false) {
+      LinearAddress4Level addr) {
     for (int i = addr.Part(page_map_level); i < 512; i++) {
       auto entry = page_map[i];
       if (!entry.bits.present) {
         continue;
       }
 
-      if (page_map_level > 1) {
+      const bool huge_page = page_map_level == 2 && entry.bits.huge_page;
+      if (page_map_level > 1 && !huge_page) {
         if (auto err = CleanPageMap(entry.Pointer(), page_map_level - 1, addr)) {
           return err;
         }
-      }
-
-      if (entry.bits.writable || clean_readonly) {
-        const auto entry_addr = reinterpret_cast<uintptr_t>(entry.Pointer());
-        const FrameID map_frame{entry_addr / kBytesPerFrame};
-        if (auto err = memory_manager->Free(map_frame, 1)) {
+        if (auto err = FreePageMap(entry.Pointer())) {
+          return err;
+        }
+      } else {
+        const size_t num_frames = huge_page ? kPagesPerHugePage : 1;
+        if (auto err = memory_manager->Release(FrameOf(entry), num_frames)) {
           return err;
         }
       }
@@ -127,9 +290,9 @@ namespace {
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  const FileMapping* FindFileMapping(const std::vector<FileMapping>& fmaps,
+  FileMapping* FindFileMapping(std::vector<FileMapping>& fmaps,
       uint64_t causal_vaddr) {
-    for (const FileMapping& m : fmaps) {
+    for (FileMapping& m : fmaps) {
       if (m.vaddr_begin <= causal_vaddr && causal_vaddr < m.vaddr_end) {
         return &m;
       }
@@ -137,44 +300,229 @@ namespace {
     return nullptr;
   }
 
-  Error PreparePageCache(FileDescriptor& fd, const FileMapping& m,
-                       uint64_t causal_vaddr) {
-    LinearAddress4Level page_vaddr{causal_vaddr};
-    page_vaddr.parts.offset = 0;
-    if (auto err = SetupPageMaps(page_vaddr, 1)) {
-      return err;
+  //entry of the given level for addr, nullptr if an upper table is missing
+  PageMapEntry* FindPageMapEntry(PageMapEntry* pml4_table,
+      LinearAddress4Level addr, int page_map_level) {
+    auto page_map = pml4_table;
+    for (int level = 4; level > page_map_level; level--) {
+      const auto& entry = page_map[addr.Part(level)];
+      if (!entry.bits.present || entry.bits.huge_page) {
+        return nullptr;
+      }
+      page_map = entry.Pointer();
     }
+    return &page_map[addr.Part(page_map_level)];
+  }
+
+  //true if a 4KiB or 2MiB page maps addr in the current address space
+  bool IsMapped(LinearAddress4Level addr) {
+    const auto pml4 = CurrentPML4();
+    auto dir_entry = FindPageMapEntry(pml4, addr, 2);
+    if (dir_entry && dir_entry->bits.present && dir_entry->bits.huge_page) {
+      return true;
+    }
+    auto entry = FindPageMapEntry(pml4, addr, 1);
+    return entry && entry->bits.present;
+  }
 
-    const long file_offset = page_vaddr.value - m.vaddr_begin;
-    void* page_cache = reinterpret_cast<void*>(page_vaddr.value);
-    fd.Load(page_cache, 4096, file_offset);
+  //maps a shared page read-only, a write fault copies it
+  Error MapSharedPage(LinearAddress4Level addr, void* page) {
+    auto page_map = CurrentPML4();
+    for (int level = 4; level > 1; level--) {
+      auto& entry = page_map[addr.Part(level)];
+      if (entry.bits.present && entry.bits.huge_page) {
+        return MAKE_ERROR(Error::kAlreadyAllocated);
+      }
+      auto [child_map, err] = SetNewPageMapIfNotPresent(entry);
+      if (err) {
+        return err;
+      }
+      entry.bits.user = 1;
+      entry.bits.writable = 1;
+      page_map = child_map;
+    }
+
+    auto& entry = page_map[addr.Part(1)];
+    if (!entry.bits.present) {
+      memory_manager->AddRef(FrameID{reinterpret_cast<uintptr_t>(page) / kBytesPerFrame});
+      entry.SetPointer(reinterpret_cast<PageMapEntry*>(page));
+      entry.bits.present = 1;
+      entry.bits.user = 1;
+      entry.bits.writable = 0;
+      paging_stat.mapped_4k_pages++;
+    }
     return MAKE_ERROR(Error::kSuccess);
   }
 
-  Error SetPageContent(PageMapEntry* table, int part,
-      LinearAddress4Level addr, PageMapEntry* content) {
-    if(part == 1){
-      const auto i = addr.Part(part);
-      table[i].SetPointer(content);
-      table[i].bits.writable = 1;
-      //flesh cache
-      InvalidateTLB(addr.value);
+  Error PrepareFilePage(FileDescriptor& fd, const FileMapping& m,
+                        uint64_t page_vaddr) {
+    //read-ahead may reach pages an earlier window mapped: a shared page
+    //must stay read-only and a private one keeps the app's changes
+    if (IsMapped(LinearAddress4Level{page_vaddr})) {
       return MAKE_ERROR(Error::kSuccess);
     }
+    const long file_offset = page_vaddr - m.vaddr_begin;
+    if (auto entry = fd.DirEntry()) {
+      auto [page, err] = page_cache->GetPage(fd, *entry, file_offset / kPageSize4K);
+      if (!err) {
+        return MapSharedPage(LinearAddress4Level{page_vaddr}, page);
+      } else if (err.Cause() != Error::kFull) {
+        return err;
+      }
+    }
+
+    //private copy for descriptors without a volume entry or a full cache
+    if (auto err = SetupPageMaps(LinearAddress4Level{page_vaddr}, 1)) {
+      return err;
+    }
+    fd.Load(reinterpret_cast<void*>(page_vaddr), kPageSize4K, file_offset);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  const size_t kInitialReadAheadPages = 4;
+  const size_t kMaxReadAheadPages = 32;
+
+  Error PreparePageCache(FileDescriptor& fd, FileMapping& m,
+                       uint64_t causal_vaddr) {
+    const uint64_t page_vaddr = causal_vaddr & ~(kPageSize4K - 1);
+    if (m.readahead_pages != 0 && page_vaddr == m.next_fault) {
+      m.readahead_pages = std::min(m.readahead_pages * 2, kMaxReadAheadPages);
+    } else {
+      m.readahead_pages = kInitialReadAheadPages;
+    }
 
-    const auto i = addr.Part(part);
-    return SetPageContent(table[i].Pointer(), part - 1, addr, content);
+    uint64_t vaddr = page_vaddr;
+    for (size_t i = 0; i < m.readahead_pages && vaddr < m.vaddr_end; i++) {
+      if (auto err = PrepareFilePage(fd, m, vaddr)) {
+        return err;
+      }
+      vaddr += kPageSize4K;
+    }
+    m.next_fault = vaddr;
+    return MAKE_ERROR(Error::kSuccess);
   }
 
+  //copy-on-write for a huge page. when no 2MiB block is left, the copy is
+  //made of 4KiB pages
+  Error CopyHugePage(PageMapEntry& entry, uint64_t causal_addr) {
+    const auto huge_addr = causal_addr & ~(kPageSize2M - 1);
+    const auto src = reinterpret_cast<const uint8_t*>(huge_addr);
+    const auto old_frame = FrameOf(entry);
+
+    if (auto huge = NewHugePage(); !huge.error) {
+      memcpy(huge.value, src, kPageSize2M);
+      entry.SetPointer(huge.value);
+      paging_stat.mapped_2m_pages++;
+    } else {
+      auto [table, err] = NewPageMap();
+      if (err) {
+        return err;
+      }
+      for (size_t i = 0; i < kPagesPerHugePage; i++) {
+        auto [p, err] = NewPageMap();
+        if (err) {
+          //table is not linked yet, drop it with the pages copied so far
+          CleanPageMap(table, 1, LinearAddress4Level{0});
+          FreePageMap(table);
+          return err;
+        }
+        memcpy(p, src + i * kPageSize4K, kPageSize4K);
+        table[i].SetPointer(p);
+        table[i].bits.present = 1;
+        table[i].bits.user = 1;
+        table[i].bits.writable = 1;
+      }
+      entry.SetPointer(table);
+      entry.bits.huge_page = 0;
+      paging_stat.mapped_4k_pages += kPagesPerHugePage;
+    }
+
+    entry.bits.writable = 1;
+    InvalidateTLB(huge_addr);
+    paging_stat.cow_copies++;
+    return memory_manager->Release(old_frame, kPagesPerHugePage);
+  }
+
+  //write to a read-only page. a page with a single owner is made writable
+  //in place, a shared one is copied
   Error CopyOnePage(uint64_t causal_addr) {
-    auto [p, err] = NewPageMap();
-    if(err){
-      return err;
+    const auto pml4 = CurrentPML4();
+    const LinearAddress4Level addr{causal_addr};
+    auto dir_entry = FindPageMapEntry(pml4, addr, 2);
+    if (dir_entry && dir_entry->bits.huge_page) {
+      if (memory_manager->RefCount(FrameOf(*dir_entry)) > 1) {
+        return CopyHugePage(*dir_entry, causal_addr);
+      }
+      dir_entry->bits.writable = 1;
+      InvalidateTLB(causal_addr);
+      paging_stat.cow_reuses++;
+      return MAKE_ERROR(Error::kSuccess);
+    }
+
+    auto entry = FindPageMapEntry(pml4, addr, 1);
+    if (entry == nullptr || !entry->bits.present) {
+      return MAKE_ERROR(Error::kIndexOutOfRange);
+    }
+
+    const auto old_frame = FrameOf(*entry);
+    if (memory_manager->RefCount(old_frame) > 1) {
+      auto [p, err] = NewPageMap();
+      if(err){
+        return err;
+      }
+      const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
+      memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
+      entry->SetPointer(p);
+      memory_manager->Release(old_frame);
+      paging_stat.cow_copies++;
+    } else {
+      paging_stat.cow_reuses++;
     }
-    const auto aligned_addr = causal_addr & 0xffff'ffff'ffff'f000;
-    memcpy(p, reinterpret_cast<const void*>(aligned_addr), 4096);
-    return SetPageContent(reinterpret_cast<PageMapEntry*>(GetCR3()), 4,
-                          LinearAddress4Level{causal_addr}, p);
+    entry->bits.writable = 1;
+    //flesh cache
+    InvalidateTLB(causal_addr);
+    return MAKE_ERROR(Error::kSuccess);
+  }
+
+  const size_t kMaxFaultAroundPages = 64;
+
+  Error SetupDemandPage(Task& task, uint64_t causal_addr) {
+    //map the whole 2MiB block at once when it lies inside the demand paging
+    //range and nothing in it is mapped yet
+    const auto huge_addr = causal_addr & ~(kPageSize2M - 1);
+    if (huge_page_enabled && task.DPagingBegin() <= huge_addr &&
+        huge_addr + kPageSize2M <= task.DPagingEnd()) {
+      const auto pml4 = CurrentPML4();
+      auto dir_entry = FindPageMapEntry(pml4, LinearAddress4Level{huge_addr}, 2);
+      if (dir_entry == nullptr || !dir_entry->bits.present) {
+        return SetupPageMaps(LinearAddress4Level{huge_addr}, kPagesPerHugePage);
+      }
+    }
+
+    const auto page_addr = causal_addr & ~(kPageSize4K - 1);
+    auto& fa = task.DPagingFaultAround();
+    if (!fa.enabled) {
+      return SetupPageMaps(LinearAddress4Level{page_addr}, 1);
+    }
+
+    //grow the window while faults walk forward right after the last window,
+    //shrink it on random access
+    if (page_addr == fa.last_end) {
+      fa.window_pages = std::min(fa.window_pages * 2, kMaxFaultAroundPages);
+    } else {
+      fa.window_pages = std::max<size_t>(fa.window_pages / 2, 1);
+    }
+    const auto max_4kpages = std::min<uint64_t>(
+        fa.window_pages, (task.DPagingEnd() - page_addr) / kPageSize4K);
+    //end the window at the first page already mapped so that its entry
+    //keeps its frame and flags and is not counted again
+    uint64_t num_4kpages = 1;
+    while (num_4kpages < max_4kpages &&
+           !IsMapped(LinearAddress4Level{page_addr + num_4kpages * kPageSize4K})) {
+      num_4kpages++;
+    }
+    fa.last_end = page_addr + num_4kpages * kPageSize4K;
+    return SetupPageMaps(LinearAddress4Level{page_addr}, num_4kpages);
   }
 } //namespace
 
@@ -195,18 +543,36 @@ Error FreePageMap(PageMapEntry* table){
 }
 
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages, bool writable) {
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());
+  auto pml4_table = CurrentPML4();
   return SetupPageMap(pml4_table, 4, addr, num_4kpages, writable).error;
 }
 
+Error SetupHugePageMap(LinearAddress4Level addr, bool writable) {
+  auto page_map = CurrentPML4();
+  for (int level = 4; level > 2; level--) {
+    auto& entry = page_map[addr.Part(level)];
+    auto [child_map, err] = SetNewPageMapIfNotPresent(entry);
+    if (err) {
+      return err;
+    }
+    entry.bits.user = 1;
+    entry.bits.writable = true;
+    page_map = child_map;
+  }
+  if (SetupHugePage(page_map[addr.Part(2)], addr, kPagesPerHugePage, writable) == 0) {
+    return MAKE_ERROR(Error::kNoEnoughMemory);
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
 Error CleanPageMaps(LinearAddress4Level addr){
-  auto pml4_table = reinterpret_cast<PageMapEntry*>(GetCR3());     
+  auto pml4_table = CurrentPML4();     
   return CleanPageMap(pml4_table, 4, addr);
 }
 
 Error CleanPageMapsForMeta(PageMapEntry* pml4_table){
    if(auto err = CleanPageMap(pml4_table, 4, 
-      LinearAddress4Level{0xffff'8000'0000'0000}, true)){
+      LinearAddress4Level{0xffff'8000'0000'0000})){
         return err;
       }
 
@@ -221,6 +587,7 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
       }
       dest[i] = src[i];
       dest[i].bits.writable = 0;
+      memory_manager->AddRef(FrameOf(src[i]));
     }
     return MAKE_ERROR(Error::kSuccess);
   }else{
@@ -228,6 +595,12 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
       if(!src[i].bits.present){
         continue;
       }
+      if(part == 2 && src[i].bits.huge_page){
+        dest[i] = src[i];
+        dest[i].bits.writable = 0;
+        memory_manager->AddRef(FrameOf(src[i]));
+        continue;
+      }
       auto [table, err] = NewPageMap();
       if(err){
         return err;
@@ -242,8 +615,24 @@ Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start) {
   }
 }
 
+uint64_t PhysicalAddress(uint64_t addr) {
+  const auto pml4 = CurrentPML4();
+  const LinearAddress4Level laddr{addr};
+  auto dir_entry = FindPageMapEntry(pml4, laddr, 2);
+  if (dir_entry && dir_entry->bits.present && dir_entry->bits.huge_page) {
+    return (dir_entry->bits.addr << 12) | (addr & (kPageSize2M - 1));
+  }
+  auto entry = FindPageMapEntry(pml4, laddr, 1);
+  if (entry == nullptr || !entry->bits.present) {
+    return 0;
+  }
+  return (entry->bits.addr << 12) | (addr & (kPageSize4K - 1));
+}
+
 Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
   auto& task = task_manager->CurrentTask();
+  paging_stat.page_faults++;
+  task.CountPageFault();
   const bool present = (error_code >> 0) & 1;
   const bool rw      = (error_code >> 1) & 1;
   const bool user    = (error_code >> 2) & 1;
@@ -255,7 +644,7 @@ Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
   }
 
   if (task.DPagingBegin() <= causal_addr && causal_addr < task.DPagingEnd()) {
-    return SetupPageMaps(LinearAddress4Level{causal_addr}, 1);
+    return SetupDemandPage(task, causal_addr);
   }
 
   if (auto m = FindFileMapping(task.FileMaps(), causal_addr)) {
@@ -264,4 +653,43 @@ Error HandlePageFault(uint64_t error_code, uint64_t causal_addr) {
    return MAKE_ERROR(Error::kIndexOutOfRange);
 
 
-}
\ No newline at end of file
+}
+
+Error MapKernelPages(uint64_t vaddr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; i++) {
+    const LinearAddress4Level addr{vaddr + i * kPageSize4K};
+    auto page_map = reinterpret_cast<PageMapEntry*>(pml4_table.data());
+    for (int level = 4; level >= 1; level--) {
+      auto& entry = page_map[addr.Part(level)];
+      auto [child_map, err] = SetNewPageMapIfNotPresent(entry);
+      if (err) {
+        return err;
+      }
+      entry.bits.writable = 1;
+      page_map = child_map;
+    }
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+Error UnmapKernelPages(uint64_t vaddr, size_t num_4kpages) {
+  for (size_t i = 0; i < num_4kpages; i++) {
+    const LinearAddress4Level addr{vaddr + i * kPageSize4K};
+    auto entry = FindPageMapEntry(
+        reinterpret_cast<PageMapEntry*>(pml4_table.data()), addr, 1);
+    if (entry == nullptr || !entry->bits.present) {
+      continue;
+    }
+    if (auto err = FreePageMap(entry->Pointer())) {
+      return err;
+    }
+    entry->data = 0;
+    InvalidateTLB(addr.value);
+  }
+  //the heap range is shared, other PCIDs and other CPUs may still cache
+  //the old pages. The others flush when they take the kernel lock
+  kernel_tlb_gen++;
+  cpu_tlb_gen[CurrentCPU()] = kernel_tlb_gen;
+  pcid_fresh[CurrentCPU()].reset();
+  return MAKE_ERROR(Error::kSuccess);
+}
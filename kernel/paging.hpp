@@ -7,6 +7,10 @@
 
 const size_t kPageDirectoryCount = 64;
 
+//kernel heap range, shared by every address space through one pml4 entry
+const uint64_t kKernelHeapBase = 0x0000'0080'0000'0000;
+const uint64_t kKernelHeapMaxBytes = 0x0000'0080'0000'0000;
+
 void SetupIdentityPageTable();
 
 void InitializePaging();
@@ -74,11 +78,53 @@ union PageMapEntry {
   }
 };
 
+//pml4 of the running address space, CR3 without the PCID bits
+PageMapEntry* CurrentPML4();
+
+const uint64_t kCR3PCIDMask = 0xfff;
+//set in a CR3 value to keep the TLB entries of its PCID
+const uint64_t kCR3NoFlush = 1ul << 63;
+
+//PCID for a new address space, 0 (shared with the kernel pml4, always
+//flushed) when PCIDs are unsupported or exhausted
+uint64_t AllocatePCID();
+void FreePCID(uint64_t pcid);
+//CR3 value for a context switch, with the no-flush hint when the TLB
+//entries of its PCID are still valid
+uint64_t CR3ForSwitch(uint64_t cr3);
+//flushes the TLB of this CPU if another CPU unmapped kernel heap pages
+//since the last call, called with the kernel lock taken
+void SyncKernelTLB();
+//the next switch to cr3 on the CPU flushes its PCID, for a task that
+//moves there and may have changed its page tables elsewhere
+void ForgetPCID(uint64_t cr3, int cpu);
+
 WithError<PageMapEntry*> NewPageMap();
 Error FreePageMap(PageMapEntry* table);
 Error SetupPageMaps(LinearAddress4Level addr, size_t num_4kpages,
                     bool writable = true);
+//maps one 2MiB page at the aligned addr, fails instead of using 4KiB pages
+Error SetupHugePageMap(LinearAddress4Level addr, bool writable = true);
 Error CleanPageMaps(LinearAddress4Level addr);
 Error CleanPageMapsForMeta(PageMapEntry* pml4_table);
 Error CopyPageMaps(PageMapEntry* dest, PageMapEntry* src, int part, int start);
-Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
\ No newline at end of file
+Error HandlePageFault(uint64_t error_code, uint64_t causal_addr);
+//physical address of addr in the current address space, 0 if not mapped
+uint64_t PhysicalAddress(uint64_t addr);
+
+struct PagingStat {
+  uint64_t page_faults;
+  uint64_t mapped_4k_pages;
+  uint64_t mapped_2m_pages;
+  //write faults on read-only pages, copied or made writable in place
+  uint64_t cow_copies;
+  uint64_t cow_reuses;
+};
+
+extern PagingStat paging_stat;
+//app memory uses 2MiB pages where a region is aligned and large enough
+extern bool huge_page_enabled;
+
+//map/unmap fresh frames in the kernel heap range (supervisor only)
+Error MapKernelPages(uint64_t vaddr, size_t num_4kpages);
+Error UnmapKernelPages(uint64_t vaddr, size_t num_4kpages);
\ No newline at end of file
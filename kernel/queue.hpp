@@ -1,6 +1,10 @@
 #pragma once
 
 #include <array>
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <optional>
 
 #include "error.hpp"
 #include "logger.hpp"
@@ -80,4 +84,160 @@ Error ArrayQueue<T>::Pop(){
     _read_pos = 0;
   }
   return MAKE_ERROR(Error::kSuccess);
-}
\ No newline at end of file
+}
+
+
+//bounded ring with many producers and one consumer.
+//Push never allocates and never masks interrupts, so interrupt handlers
+//may post into it while a task is pushing or popping (Vyukov's bounded queue).
+//a full ring drops the new value and counts it.
+//the consumer may fold following values into the one it pops
+template<typename T>
+class MPSCRing{
+  public:
+    struct Stat {
+      size_t capacity, count, high_water;
+      uint64_t dropped, merged;
+    };
+
+    //capacity must be a power of 2
+    explicit MPSCRing(size_t capacity);
+    ~MPSCRing();
+    MPSCRing(const MPSCRing&) = delete;
+    MPSCRing& operator=(const MPSCRing&) = delete;
+
+    Error Push(const T& value);
+    std::optional<T> Pop();
+    //pops the front and merges the values after it for as long as
+    //merge(front, next) returns true
+    template<class Merge>
+    std::optional<T> Pop(Merge merge);
+    bool Empty() const;
+    Stat GetStat() const;
+
+  private:
+    static const size_t kCacheLineBytes = 64;
+
+    struct Cell {
+      std::atomic<size_t> seq;
+      T value;
+    };
+
+    const size_t _mask;
+    uint8_t* _buf;
+    //cache line aligned part of _buf
+    Cell* _cells;
+    std::atomic<uint64_t> _dropped{0};
+    std::atomic<uint64_t> _merged{0};
+    std::atomic<size_t> _high_water{0};
+    //keep producer and consumer positions on different cache lines
+    std::atomic<size_t> _write_pos{0};
+    uint8_t _pad[kCacheLineBytes];
+    std::atomic<size_t> _read_pos{0};
+};
+
+template<typename T>
+MPSCRing<T>::MPSCRing(size_t capacity) :
+    _mask{capacity - 1},
+    _buf{new uint8_t[capacity * sizeof(Cell) + kCacheLineBytes]} {
+  auto addr = reinterpret_cast<uintptr_t>(_buf);
+  addr = (addr + kCacheLineBytes - 1) & ~(kCacheLineBytes - 1);
+  _cells = reinterpret_cast<Cell*>(addr);
+  for (size_t i = 0; i < capacity; ++i) {
+    new(&_cells[i]) Cell{{i}, T{}};
+  }
+}
+
+template<typename T>
+MPSCRing<T>::~MPSCRing(){
+  for (size_t i = 0; i <= _mask; ++i) {
+    _cells[i].~Cell();
+  }
+  delete[] _buf;
+}
+
+template<typename T>
+Error MPSCRing<T>::Push(const T& value){
+  size_t pos = _write_pos.load(std::memory_order_relaxed);
+  Cell* cell;
+  while (true) {
+    cell = &_cells[pos & _mask];
+    const size_t seq = cell->seq.load(std::memory_order_acquire);
+    const auto diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      //claim the cell, a nested producer may have taken it first
+      if (_write_pos.compare_exchange_weak(pos, pos + 1,
+                                           std::memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      _dropped.fetch_add(1, std::memory_order_relaxed);
+      return MAKE_ERROR(Error::kFull);
+    } else {
+      pos = _write_pos.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->value = value;
+  cell->seq.store(pos + 1, std::memory_order_release);
+
+  const size_t count = pos + 1 - _read_pos.load(std::memory_order_relaxed);
+  size_t high_water = _high_water.load(std::memory_order_relaxed);
+  while (count > high_water &&
+         !_high_water.compare_exchange_weak(high_water, count,
+                                            std::memory_order_relaxed)) {
+  }
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+template<typename T>
+std::optional<T> MPSCRing<T>::Pop(){
+  const size_t pos = _read_pos.load(std::memory_order_relaxed);
+  Cell& cell = _cells[pos & _mask];
+  if (cell.seq.load(std::memory_order_acquire) != pos + 1) {
+    return std::nullopt;
+  }
+
+  T value = cell.value;
+  cell.seq.store(pos + _mask + 1, std::memory_order_release);
+  _read_pos.store(pos + 1, std::memory_order_relaxed);
+  return value;
+}
+
+template<typename T>
+template<class Merge>
+std::optional<T> MPSCRing<T>::Pop(Merge merge){
+  auto value = Pop();
+  if (!value) {
+    return value;
+  }
+
+  while (true) {
+    const size_t pos = _read_pos.load(std::memory_order_relaxed);
+    Cell& cell = _cells[pos & _mask];
+    if (cell.seq.load(std::memory_order_acquire) != pos + 1 ||
+        !merge(*value, cell.value)) {
+      break;
+    }
+    cell.seq.store(pos + _mask + 1, std::memory_order_release);
+    _read_pos.store(pos + 1, std::memory_order_relaxed);
+    _merged.fetch_add(1, std::memory_order_relaxed);
+  }
+  return value;
+}
+
+template<typename T>
+bool MPSCRing<T>::Empty() const{
+  const size_t pos = _read_pos.load(std::memory_order_relaxed);
+  return _cells[pos & _mask].seq.load(std::memory_order_acquire) != pos + 1;
+}
+
+template<typename T>
+typename MPSCRing<T>::Stat MPSCRing<T>::GetStat() const{
+  return { _mask + 1,
+           _write_pos.load(std::memory_order_relaxed) -
+             _read_pos.load(std::memory_order_relaxed),
+           _high_water.load(std::memory_order_relaxed),
+           _dropped.load(std::memory_order_relaxed),
+           _merged.load(std::memory_order_relaxed) };
+}
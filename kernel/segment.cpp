@@ -5,16 +5,16 @@
 #include "logger.hpp"
 #include "memory_manager.hpp"
 #include "interrupt.hpp"
+#include "smp.hpp"
 
 namespace{
-  std::array<SegmentDescriptor, 7> gdt;
-  std::array<uint32_t, 26> tss;
+  //one 16 byte TSS descriptor per CPU from kTSS
+  std::array<SegmentDescriptor, (kTSS >> 3) + 2 * kMaxCPUs> gdt;
+  std::array<std::array<uint32_t, 26>, kMaxCPUs> tss;
 
-  static_assert((kTSS >> 3) + 1 < gdt.size());
-
-  void SetTSS(int index, uint64_t value) {
-    tss[index]     = value & 0xffffffff;
-    tss[index + 1] = value >> 32;
+  void SetTSS(int cpu, int index, uint64_t value) {
+    tss[cpu][index]     = value & 0xffffffff;
+    tss[cpu][index + 1] = value >> 32;
   }
 
   uint64_t AllocateStackArea(int num_4kframes) {
@@ -87,7 +87,15 @@ void InitializeSegmentation(){
   SetCSSS(kKernelCS, kKernelSS);
 }
 
-void InitializeTSS() {
+void InitializeSegmentationForAP(){
+  //the BSP has set up the gdt already
+  LoadGDT(sizeof(gdt) - 1, reinterpret_cast<uintptr_t>(&gdt[0]));
+
+  SetDSAll(kKernelDS);
+  SetCSSS(kKernelCS, kKernelSS);
+}
+
+void InitializeTSS(int cpu) {
   // const int kRSP0Frames = 8;
   // auto [ stack0, err ] = memory_manager->Allocate(kRSP0Frames);
   // if (err) {
@@ -98,13 +106,14 @@ void InitializeTSS() {
   //   reinterpret_cast<uint64_t>(stack0.Frame()) + kRSP0Frames * 4096;
   // tss[1] = rsp0 & 0xffffffff;
   // tss[2] = rsp0 >> 32;
-  SetTSS(1, AllocateStackArea(8));
-  SetTSS(7 + 2 * kISTForTimer, AllocateStackArea(8));
+  SetTSS(cpu, 1, AllocateStackArea(8));
+  SetTSS(cpu, 7 + 2 * kISTForTimer, AllocateStackArea(8));
 
-  uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[0]);
-  SetSystemSegment(gdt[kTSS >> 3], DescriptorType::kTSSAvailable, 0,
-                   tss_addr & 0xffffffff, sizeof(tss)-1);
-  gdt[(kTSS >> 3) + 1].data = tss_addr >> 32;
+  const uint16_t tss_sel = TSSSelector(cpu);
+  uint64_t tss_addr = reinterpret_cast<uint64_t>(&tss[cpu][0]);
+  SetSystemSegment(gdt[tss_sel >> 3], DescriptorType::kTSSAvailable, 0,
+                   tss_addr & 0xffffffff, sizeof(tss[cpu])-1);
+  gdt[(tss_sel >> 3) + 1].data = tss_addr >> 32;
 
-  LoadTR(kTSS);
+  LoadTR(tss_sel);
 }
\ No newline at end of file
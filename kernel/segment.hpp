@@ -38,6 +38,12 @@ const uint16_t kKernelSS = 2 << 3;
 const uint16_t kKernelDS = 0;
 const uint16_t kTSS = 5 << 3;
 
+inline uint16_t TSSSelector(int cpu) {
+  return kTSS + cpu * 16;
+}
+
 
 void InitializeSegmentation();
-void InitializeTSS();
\ No newline at end of file
+void InitializeSegmentationForAP();
+//TSS with the stacks for interrupts of the given CPU, 0 is the BSP
+void InitializeTSS(int cpu = 0);
\ No newline at end of file
@@ -0,0 +1,207 @@
+#include "slab.hpp"
+
+#include "logger.hpp"
+
+struct SlabCache::Slab {
+  SlabCache* cache;
+  Slab* prev;
+  Slab* next;
+  uint16_t used;
+  uint16_t free_count;
+  //followed by the stack of free object indices, then the objects
+
+  uint16_t* FreeIndex() {
+    return reinterpret_cast<uint16_t*>(this + 1);
+  }
+};
+
+namespace {
+  template <class T>
+  void PushSlab(T*& head, T* slab) {
+    slab->prev = nullptr;
+    slab->next = head;
+    if (head) {
+      head->prev = slab;
+    }
+    head = slab;
+  }
+
+  template <class T>
+  void RemoveSlab(T*& head, T* slab) {
+    if (slab->prev) {
+      slab->prev->next = slab->next;
+    } else {
+      head = slab->next;
+    }
+    if (slab->next) {
+      slab->next->prev = slab->prev;
+    }
+    slab->prev = slab->next = nullptr;
+  }
+
+  size_t RoundUp(size_t value, size_t align) {
+    return (value + align - 1) & ~(align - 1);
+  }
+}
+
+SlabCache* SlabCache::_first_cache = nullptr;
+
+size_t SlabCache::ObjectsPerSlab() const {
+  return (kBytesPerFrame - sizeof(Slab) - kObjectAlign) /
+      (_object_bytes + sizeof(uint16_t));
+}
+
+SlabCache::Slab* SlabCache::NewSlab() {
+  const auto num_objects = ObjectsPerSlab();
+  if (num_objects == 0) {
+    Log(kError, "slab %s: object too large (%lu bytes)\n", _name, _object_bytes);
+    return nullptr;
+  }
+
+  const auto frame = memory_manager->Allocate(1);
+  if (frame.error) {
+    return nullptr;
+  }
+
+  if (!_registered) {
+    _registered = true;
+    _next_cache = _first_cache;
+    _first_cache = this;
+  }
+
+  auto slab = reinterpret_cast<Slab*>(frame.value.Frame());
+  slab->cache = this;
+  slab->prev = slab->next = nullptr;
+  slab->used = 0;
+  slab->free_count = num_objects;
+
+  for (size_t i = 0; i < num_objects; i++) {
+    //lowest index on the top of the stack
+    slab->FreeIndex()[i] = num_objects - 1 - i;
+  }
+
+  _slab_count++;
+  return slab;
+}
+
+void* SlabCache::Allocate() {
+  if (_partial == nullptr) {
+    Slab* slab = _empty;
+    if (slab) {
+      _empty = nullptr;
+    } else if ((slab = NewSlab()) == nullptr) {
+      return nullptr;
+    }
+    PushSlab(_partial, slab);
+  }
+
+  Slab* slab = _partial;
+  const auto index = slab->FreeIndex()[--slab->free_count];
+  slab->used++;
+  _used_objects++;
+  if (slab->free_count == 0) {
+    RemoveSlab(_partial, slab);
+    PushSlab(_full, slab);
+  }
+
+  auto objects = reinterpret_cast<uint8_t*>(slab) +
+      RoundUp(sizeof(Slab) + ObjectsPerSlab() * sizeof(uint16_t), kObjectAlign);
+  return objects + index * _object_bytes;
+}
+
+void* SlabCache::AllocateForNew(size_t bytes) {
+  if (bytes > _object_bytes) {
+    Log(kError, "slab %s: %lu bytes do not fit in %lu byte objects\n",
+        _name, bytes, _object_bytes);
+    while (1) __asm__("hlt");
+  }
+  if (auto obj = Allocate()) {
+    return obj;
+  }
+  Log(kError, "slab %s: out of memory\n", _name);
+  while (1) __asm__("hlt");
+}
+
+void SlabCache::Free(void* obj) {
+  if (obj == nullptr) {
+    return;
+  }
+
+  const auto obj_addr = reinterpret_cast<uintptr_t>(obj);
+  auto slab = reinterpret_cast<Slab*>(obj_addr & ~(kBytesPerFrame - 1));
+  if (slab->cache != this) {
+    Log(kError, "slab %s: %p is not owned by this cache\n", _name, obj);
+    return;
+  }
+
+  const auto objects = reinterpret_cast<uintptr_t>(slab) +
+      RoundUp(sizeof(Slab) + ObjectsPerSlab() * sizeof(uint16_t), kObjectAlign);
+  if (slab->free_count == 0) {
+    RemoveSlab(_full, slab);
+    PushSlab(_partial, slab);
+  }
+  slab->FreeIndex()[slab->free_count++] = (obj_addr - objects) / _object_bytes;
+  slab->used--;
+  _used_objects--;
+
+  if (slab->used == 0) {
+    RemoveSlab(_partial, slab);
+    if (_empty == nullptr) {
+      _empty = slab;
+    } else {
+      slab->cache = nullptr;
+      memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(slab) / kBytesPerFrame}, 1);
+      _slab_count--;
+    }
+  }
+}
+
+SlabStat SlabCache::Stat() const {
+  return { _name, _object_bytes, _used_objects,
+           _slab_count * ObjectsPerSlab(), _slab_count };
+}
+
+namespace {
+  SlabCache size_class_caches[] = {
+    {"size-32", 32},
+    {"size-64", 64},
+    {"size-128", 128},
+    {"size-256", 256},
+    {"size-512", 512},
+    {"size-1024", 1024},
+  };
+  const size_t kMaxSizeClassBytes = 1024;
+
+  SlabCache* SizeClassCache(size_t bytes) {
+    size_t class_bytes = 32;
+    for (auto& cache : size_class_caches) {
+      if (bytes <= class_bytes) {
+        return &cache;
+      }
+      class_bytes *= 2;
+    }
+    return nullptr;
+  }
+}
+
+void* SlabAllocate(size_t bytes) {
+  if (bytes <= kMaxSizeClassBytes) {
+    return SizeClassCache(bytes)->Allocate();
+  }
+
+  const auto frame = memory_manager->Allocate((bytes + kBytesPerFrame - 1) / kBytesPerFrame);
+  if (frame.error) {
+    return nullptr;
+  }
+  return frame.value.Frame();
+}
+
+void SlabFree(void* p, size_t bytes) {
+  if (bytes <= kMaxSizeClassBytes) {
+    SizeClassCache(bytes)->Free(p);
+    return;
+  }
+
+  memory_manager->Free(FrameID{reinterpret_cast<uintptr_t>(p) / kBytesPerFrame},
+      (bytes + kBytesPerFrame - 1) / kBytesPerFrame);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include "memory_manager.hpp"
+
+struct SlabStat {
+  const char* name;
+  size_t object_bytes;
+  size_t used_objects;
+  size_t total_objects;
+  size_t slab_frames;
+};
+
+/*
+ * object cache carved from single frames of memory_manager.
+ */
+class SlabCache{
+  public:
+    static const size_t kObjectAlign = 16;
+
+    constexpr SlabCache(const char* name, size_t object_bytes)
+        : _name{name},
+          _object_bytes{(object_bytes + kObjectAlign - 1) & ~(kObjectAlign - 1)}{
+    }
+    SlabCache(const SlabCache&) = delete;
+    SlabCache& operator=(const SlabCache&) = delete;
+
+    void* Allocate();
+    //for a class operator new, which must not return null: halts when
+    //bytes is larger than the objects or no memory is left
+    void* AllocateForNew(size_t bytes);
+    void Free(void* obj);
+    SlabStat Stat() const;
+
+    static SlabCache* First() { return _first_cache; }
+    SlabCache* Next() const { return _next_cache; }
+
+  private:
+    struct Slab;
+
+    const char* _name;
+    size_t _object_bytes;
+    //slabs with at least one free object
+    Slab* _partial{nullptr};
+    Slab* _full{nullptr};
+    //one empty slab is kept to avoid frame ping-pong
+    Slab* _empty{nullptr};
+    size_t _used_objects{0};
+    size_t _slab_count{0};
+    bool _registered{false};
+    SlabCache* _next_cache{nullptr};
+
+    static SlabCache* _first_cache;
+
+    Slab* NewSlab();
+    size_t ObjectsPerSlab() const;
+};
+
+//size class caches for small blocks, larger blocks take whole frames
+void* SlabAllocate(size_t bytes);
+void SlabFree(void* p, size_t bytes);
+
+template <class T>
+class SlabAllocator{
+  public:
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <class U>
+    SlabAllocator(const SlabAllocator<U>&){}
+
+    T* allocate(size_t n){
+      return reinterpret_cast<T*>(SlabAllocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t n){
+      SlabFree(p, n * sizeof(T));
+    }
+};
+
+template <class T, class U>
+bool operator==(const SlabAllocator<T>&, const SlabAllocator<U>&){
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const SlabAllocator<T>&, const SlabAllocator<U>&){
+  return false;
+}
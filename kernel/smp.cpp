@@ -0,0 +1,202 @@
+#include "smp.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstring>
+
+#include "acpi.hpp"
+#include "asmfunc.h"
+#include "interrupt.hpp"
+#include "logger.hpp"
+#include "memory_manager.hpp"
+#include "paging.hpp"
+#include "segment.hpp"
+#include "spinlock.hpp"
+#include "syscall.hpp"
+#include "task.hpp"
+#include "timer.hpp"
+
+namespace {
+  SpinLock kernel_lock;
+  //CPU index holding kernel_lock, -1 if none
+  std::atomic<int> kernel_lock_owner{-1};
+
+  //local APIC ID -> CPU index, IDs not listed map to the BSP
+  std::array<uint8_t, 256> cpu_index{};
+  std::array<uint8_t, kMaxCPUs> cpu_apic_id{};
+  int cpu_count = 1;
+  std::atomic<bool> ap_alive{false};
+
+  const size_t kAPStackBytes = 4096 * 16;
+
+  volatile uint32_t& lapic_id = *reinterpret_cast<uint32_t*>(0xfee00020);
+  volatile uint32_t& spurious_vector = *reinterpret_cast<uint32_t*>(0xfee000f0);
+  volatile uint32_t& icr_low = *reinterpret_cast<uint32_t*>(0xfee00300);
+  volatile uint32_t& icr_high = *reinterpret_cast<uint32_t*>(0xfee00310);
+
+  void SendIPI(uint8_t apic_id, uint32_t command) {
+    icr_high = static_cast<uint32_t>(apic_id) << 24;
+    icr_low = command;
+    //bit 12: delivery status, send pending
+    while (icr_low & (1u << 12)) {
+      __asm__("pause");
+    }
+  }
+
+  bool WaitAlive(unsigned long msec) {
+    for (unsigned long i = 0; i < msec; ++i) {
+      if (ap_alive.load()) {
+        return true;
+      }
+      acpi::WaitMilliseconds(1);
+    }
+    return ap_alive.load();
+  }
+
+  void APMain(int cpu) {
+    //the startup code may be overwritten for the next AP from here
+    ap_alive.store(true);
+
+    InitializeSegmentationForAP();
+    InitializeInterruptForAP();
+    //bit 8: APIC software enable, spurious vector 0xff
+    spurious_vector = spurious_vector | 0x1ff;
+
+    AcquireKernelLock();
+    InitializeTSS(cpu);
+    InitializeSyscall();
+    task_manager->InitializeCPU(cpu);
+    InitializeLAPICTimerForAP();
+    Log(kDebug, "CPU %d started\n", cpu);
+
+    IdleLoop();
+  }
+
+  template <class T>
+  void Patch(uint8_t* boot, char* field, T value) {
+    memcpy(boot + (field - APBootStart), &value, sizeof(value));
+  }
+
+  bool StartAP(int cpu, uint8_t apic_id) {
+    auto boot = reinterpret_cast<uint8_t*>(ap_boot_frame.Frame());
+    const auto boot_addr = reinterpret_cast<uintptr_t>(boot);
+    memcpy(boot, APBootStart, APBootEnd - APBootStart);
+
+    const auto stack = new uint64_t[kAPStackBytes / sizeof(uint64_t)];
+    const uint64_t kCR0TS = 1u << 3;
+
+    Patch<uint32_t>(boot, APBootGDTR + 2, boot_addr + (APBootGDT - APBootStart));
+    Patch<uint32_t>(boot, APBootJump, boot_addr + (APBoot64 - APBootStart));
+    //the startup code loads CR3 with PCIDs disabled
+    Patch<uint64_t>(boot, APBootCR3, GetCR3() & ~kCR3NoFlush & ~kCR3PCIDMask);
+    Patch<uint64_t>(boot, APBootCR0, GetCR0() & ~kCR0TS);
+    Patch<uint64_t>(boot, APBootCR4, GetCR4());
+    Patch<uint64_t>(boot, APBootStack,
+                    reinterpret_cast<uint64_t>(stack + kAPStackBytes / sizeof(uint64_t)));
+    Patch<uint64_t>(boot, APBootEntry, reinterpret_cast<uint64_t>(APMain));
+    Patch<uint64_t>(boot, APBootCPU, cpu);
+
+    ap_alive.store(false);
+    cpu_index[apic_id] = cpu;
+    cpu_apic_id[cpu] = apic_id;
+
+    //INIT, then STARTUP twice as the MP specification recommends.
+    //bit 14: level assert, bits 8-10: delivery mode
+    SendIPI(apic_id, 0x00004500);
+    acpi::WaitMilliseconds(10);
+    const uint32_t sipi = 0x00004600 | (boot_addr >> 12);
+    SendIPI(apic_id, sipi);
+    if (!WaitAlive(1)) {
+      SendIPI(apic_id, sipi);
+    }
+    if (WaitAlive(100)) {
+      return true;
+    }
+
+    cpu_index[apic_id] = 0;
+    delete[] stack;
+    return false;
+  }
+}
+
+int CurrentCPU() {
+  return cpu_index[lapic_id >> 24];
+}
+
+int CPUCount() {
+  return cpu_count;
+}
+
+void InitializeSMP() {
+  //the BSP runs kernel code holding the lock from here on
+  AcquireKernelLock();
+
+  std::array<uint8_t, kMaxCPUs> apic_ids;
+  const size_t num_ids = acpi::LocalAPICIDs(apic_ids.data(), apic_ids.size());
+  if (ap_boot_frame.ID() == kNullFrame.ID()) {
+    Log(kWarn, "no frame below 1MiB to start APs\n");
+    return;
+  }
+
+  const uint8_t bsp_apic_id = lapic_id >> 24;
+  cpu_apic_id[0] = bsp_apic_id;
+  for (size_t i = 0; i < num_ids; ++i) {
+    if (apic_ids[i] == bsp_apic_id) {
+      continue;
+    }
+    if (!StartAP(cpu_count, apic_ids[i])) {
+      Log(kWarn, "AP (APIC ID %d) did not start\n", apic_ids[i]);
+      continue;
+    }
+    cpu_count++;
+  }
+  Log(kInfo, "%d CPUs\n", cpu_count);
+}
+
+extern "C" bool AcquireKernelLock() {
+  InterruptGuard guard;
+  const int cpu = CurrentCPU();
+  if (kernel_lock_owner.load(std::memory_order_relaxed) == cpu) {
+    return false;
+  }
+  kernel_lock.Lock();
+  kernel_lock_owner.store(cpu, std::memory_order_relaxed);
+  SyncKernelTLB();
+  return true;
+}
+
+extern "C" void ReleaseKernelLock() {
+  InterruptGuard guard;
+  if (kernel_lock_owner.load(std::memory_order_relaxed) != CurrentCPU()) {
+    return;
+  }
+  kernel_lock_owner.store(-1, std::memory_order_relaxed);
+  kernel_lock.Unlock();
+}
+
+void SendRescheduleIPI(int cpu) {
+  InterruptGuard guard;
+  if (cpu == CurrentCPU()) {
+    //bits 18-19: destination shorthand 01, self
+    SendIPI(0, 0x00040000 | InterruptVector::kReschedule);
+  } else {
+    SendIPI(cpu_apic_id[cpu], InterruptVector::kReschedule);
+  }
+}
+
+void YieldKernelLock() {
+  if (!kernel_lock.Contended()) {
+    return;
+  }
+  ReleaseKernelLock();
+  AcquireKernelLock();
+}
+
+void IdleLoop() {
+  while (true) {
+    //sti delays interrupts by one instruction, hlt cannot miss a wakeup
+    __asm__("cli");
+    ReleaseKernelLock();
+    __asm__("sti\n\thlt");
+  }
+}
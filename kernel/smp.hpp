@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+
+const int kMaxCPUs = 16;
+
+//index of the executing CPU, the BSP is 0
+int CurrentCPU();
+//CPUs running the scheduler
+int CPUCount();
+
+//starts the application processors listed in the MADT
+void InitializeSMP();
+
+//big kernel lock: a CPU holds it while it runs kernel code. It is dropped
+//when the CPU returns to user mode or goes idle, and taken again by
+//syscalls and interrupts that enter the kernel from there.
+extern "C" {
+  //returns true when this call took the lock, false if the CPU held it
+  __attribute__((no_caller_saved_registers)) bool AcquireKernelLock();
+  __attribute__((no_caller_saved_registers)) void ReleaseKernelLock();
+}
+//makes the CPU run its timer interrupt handler, which sets the timer
+//again and switches tasks when a task of a higher level woke up there
+void SendRescheduleIPI(int cpu);
+
+//lets CPUs waiting for the lock run first, like a preemption point
+void YieldKernelLock();
+//body of the idle tasks: halts without the lock until an interrupt
+[[noreturn]] void IdleLoop();
+
+class KernelLockGuard {
+  public:
+    KernelLockGuard() : _acquired{AcquireKernelLock()} {}
+    ~KernelLockGuard() {
+      if (_acquired) {
+        ReleaseKernelLock();
+      }
+    }
+    KernelLockGuard(const KernelLockGuard&) = delete;
+    KernelLockGuard& operator=(const KernelLockGuard&) = delete;
+
+  private:
+    const bool _acquired;
+};
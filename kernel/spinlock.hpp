@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+//ticket lock: waiters get the lock in the order they asked for it
+class SpinLock {
+  public:
+    constexpr SpinLock() = default;
+    SpinLock(const SpinLock&) = delete;
+    SpinLock& operator=(const SpinLock&) = delete;
+
+    void Lock() {
+      const auto ticket = _next.fetch_add(1, std::memory_order_relaxed);
+      while (_serving.load(std::memory_order_acquire) != ticket) {
+        __asm__("pause");
+      }
+    }
+
+    void Unlock() {
+      const auto serving = _serving.load(std::memory_order_relaxed);
+      _serving.store(serving + 1, std::memory_order_release);
+    }
+
+    //another CPU is spinning in Lock()
+    bool Contended() const {
+      return _next.load(std::memory_order_relaxed) -
+             _serving.load(std::memory_order_relaxed) > 1;
+    }
+
+  private:
+    std::atomic<uint32_t> _next{0};
+    std::atomic<uint32_t> _serving{0};
+};
+
+//saves RFLAGS.IF and disables interrupts until the end of the scope
+class InterruptGuard {
+  public:
+    InterruptGuard() {
+      __asm__ volatile("pushfq\n\tpop %0\n\tcli" : "=r"(_rflags) :: "memory");
+    }
+    ~InterruptGuard() {
+      if (_rflags & (1u << 9)) {
+        __asm__ volatile("sti" ::: "memory");
+      }
+    }
+    InterruptGuard(const InterruptGuard&) = delete;
+    InterruptGuard& operator=(const InterruptGuard&) = delete;
+
+  private:
+    uint64_t _rflags;
+};
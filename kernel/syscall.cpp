@@ -17,6 +17,10 @@
 #include "timer.hpp"
 #include "keyboard.hpp"
 #include "app_event.hpp"
+#include "futex.hpp"
+#include "demand_paging.hpp"
+#include "paging.hpp"
+#include "wait_queue.hpp"
 
 namespace syscall {
   struct Result {
@@ -167,6 +171,10 @@ namespace syscall {
     return { timer_manager->CurrentTick(), kTimerFreq };
   }
 
+  SYSCALL(GetMonotonicTime) {
+    return { MonotonicNanoseconds(), 1000000000 };
+  }
+
   SYSCALL(WinRedraw) {
     return DoWinFunc(
         [](Window&) {
@@ -243,13 +251,14 @@ namespace syscall {
     size_t i = 0;
 
     while (i < len) {
-      __asm__("cli");
-      auto msg = task.ReceiveMessage();
-      if (!msg && i == 0) {
-        task.Sleep();
-        continue;
+      std::optional<Message> msg;
+      if (i == 0) {
+        msg = task.WaitMessage();
+      } else {
+        __asm__("cli");
+        msg = task.ReceiveMessage();
+        __asm__("sti");
       }
-      __asm__("sti");
 
       if (!msg) {
         break;
@@ -316,12 +325,19 @@ namespace syscall {
     if (timer_value <= 0) {
       return { 0, EINVAL };
     }
+    //arg4: where to store the handle for CancelTimer, may be null
+    if (arg4 != 0 &&
+        (arg4 < 0x8000'0000'0000'0000 || arg4 % sizeof(uint64_t) != 0)) {
+      return { 0, EFAULT };
+    }
 
     __asm__("cli");
     const uint64_t task_id = task_manager->CurrentTask().ID();
     __asm__("sti");
 
-    unsigned long timeout = arg3 * kTimerFreq / 1000;
+    //bit 1: the timeout is in microseconds instead of milliseconds
+    const unsigned long unit = (mode & 2) ? 1000000 : 1000;
+    unsigned long timeout = arg3 * kTimerFreq / unit;
     //1 relative 0 absolute
     if (mode & 1) { 
       // relative
@@ -329,9 +345,78 @@ namespace syscall {
     }
 
     __asm__("cli");
-    timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+    const auto handle = timer_manager->AddTimer(Timer{timeout, -timer_value, task_id});
+    __asm__("sti");
+    if (auto handle_out = reinterpret_cast<uint64_t*>(arg4)) {
+      *handle_out = handle;
+    }
+    return { timeout * unit / kTimerFreq, 0 };
+  }
+
+  SYSCALL(CancelTimer) {
+    const uint64_t handle = arg1;
+
+    __asm__("cli");
+    const uint64_t task_id = task_manager->CurrentTask().ID();
+    const bool cancelled = timer_manager->CancelTimer(handle, task_id);
+    __asm__("sti");
+    if (!cancelled) {
+      //expired already, cancelled twice or not a timer of this app
+      return { 0, ENOENT };
+    }
+    return { 1, 0 };
+  }
+
+  SYSCALL(Futex) {
+    const uint64_t addr = arg1;
+    const int op = arg2;
+    const uint32_t val = arg3;
+    const unsigned long timeout_ms = arg4;
+    if (addr < 0x8000'0000'0000'0000 || addr % sizeof(uint32_t) != 0) {
+      return { 0, EFAULT };
+    }
+    const auto word = reinterpret_cast<volatile uint32_t*>(addr);
+
+    __asm__("cli");
+    auto& task = task_manager->CurrentTask();
+    //reading the word maps its page. The key is the physical address so
+    //apps sharing the page through the page cache wait on the same word
+    const uint32_t current = *word;
+    const uint64_t key = PhysicalAddress(addr);
+
+    if (op == FUTEX_WAKE) {
+      const size_t woken = WakeKey(key, val);
+      __asm__("sti");
+      return { woken, 0 };
+    } else if (op != FUTEX_WAIT) {
+      __asm__("sti");
+      return { 0, EINVAL };
+    }
+
+    if (current != val) {
+      __asm__("sti");
+      return { 0, EAGAIN };
+    }
+    //the timer message ends the wait like any other message
+    unsigned long deadline = 0;
+    uint64_t handle = 0;
+    if (timeout_ms > 0) {
+      deadline = timer_manager->CurrentTick() + timeout_ms * kTimerFreq / 1000;
+      handle = timer_manager->AddTimer(Timer{deadline, 0, task.ID()});
+    }
+    const bool woken = WaitOnKey(task, key);
+    __asm__("cli");
+    if (timeout_ms > 0) {
+      timer_manager->CancelTimer(handle, task.ID());
+    }
+    const bool timed_out = timeout_ms > 0 &&
+                           timer_manager->CurrentTick() >= deadline;
     __asm__("sti");
-    return { timeout * 1000 / kTimerFreq, 0 };
+
+    if (woken) {
+      return { 0, 0 };
+    }
+    return { 0, timed_out ? ETIMEDOUT : EINTR };
   }
 
   namespace {
@@ -407,11 +492,18 @@ namespace syscall {
 
   SYSCALL(DemandPages) {
     const size_t num_pages = arg1;
-    // const int flags = arg2;
+    const int flags = arg2;
     __asm__("cli");
     auto& task = task_manager->CurrentTask();
     __asm__("sti");
 
+    if (flags & ~DPAGE_FAULT_AROUND) {
+      return { 0, EINVAL };
+    }
+    if (flags & DPAGE_FAULT_AROUND) {
+      task.DPagingFaultAround().enabled = true;
+    }
+
     const uint64_t dp_end = task.DPagingEnd();
     task.SetDPagingEnd(dp_end + 4096 * num_pages);
     return { dp_end, 0 };
@@ -462,6 +554,9 @@ extern "C" std::array syscall_table{
   syscall::ReadFile,/* 0x0d */
   syscall::DemandPages,/* 0x0e */
   syscall::MapFile,/* 0x0f */
+  syscall::CancelTimer,/* 0x10 */
+  syscall::GetMonotonicTime,/* 0x11 */
+  syscall::Futex,/* 0x12 */
 };
 
 void InitializeSyscall() {
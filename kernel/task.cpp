@@ -1,12 +1,17 @@
 #include "task.hpp"
 
 #include <cstring>
+#include <cstddef>
 #include <algorithm>
+#include <limits>
 
 #include "asmfunc.h"
 #include "timer.hpp"
 #include "segment.hpp"
 #include "logger.hpp"
+#include "paging.hpp"
+#include "graphics.hpp"
+#include "wait_queue.hpp"
 
 namespace{
   template<class T, class U>
@@ -17,12 +22,88 @@ namespace{
 
   void TaskIdle(uint64_t task_id, int64_t data) {
     printk("TaskIdle: task_id=%d, data=%d\n", task_id, data);
-    while (true) __asm__("hlt");
+    IdleLoop();
   }
 
+  const uint64_t kCR0MP = 1u << 1;
+  const uint64_t kCR0TS = 1u << 3;
+
+  //per CPU: task whose FPU state the registers hold. A switch sets CR0.TS
+  //and the first FPU instruction of the next task loads its state in
+  //IntHandlerNM
+  std::array<Task*, kMaxCPUs> fpu_owner{};
+
+  //lets the next CR3 load keep the TLB entries of its PCID when possible,
+  //and skips the #NM when the registers still hold the FPU state of next
+  TaskContext& PrepareSwitch(Task& next) {
+    auto& ctx = next.Context();
+    ctx.cr3 = CR3ForSwitch(ctx.cr3);
+    ctx.cr0_ts = fpu_owner[CurrentCPU()] == &next && (GetCR0() & kCR0TS)
+        ? 0 : kCR0TS;
+    return ctx;
+  }
+
+  SlabCache task_cache{"Task", sizeof(Task)};
+
+  //adjacent mouse moves add up their deltas, redraws of the same layer
+  //by the same task draw the union of their areas
+  bool CoalesceMessage(Message& msg, const Message& next) {
+    if (msg.type != next.type || msg.src_task_id != next.src_task_id) {
+      return false;
+    }
+
+    if (msg.type == Message::kMouseMove) {
+      auto& m = msg.arg.mouse_move;
+      const auto& n = next.arg.mouse_move;
+      if (m.buttons != n.buttons) {
+        return false;
+      }
+      m.x = n.x;
+      m.y = n.y;
+      m.dx += n.dx;
+      m.dy += n.dy;
+      coalesce_stat.mouse_moves++;
+      return true;
+    }
+
+    if (msg.type == Message::kLayerOps) {
+      auto& m = msg.arg.layer;
+      const auto& n = next.arg.layer;
+      const auto is_draw = [](LayerOperation op) {
+        return op == LayerOperation::Draw || op == LayerOperation::DrawArea;
+      };
+      if (m.layer_id != n.layer_id || !is_draw(m.op) || !is_draw(n.op)) {
+        return false;
+      }
+      if (m.op == LayerOperation::DrawArea && n.op == LayerOperation::DrawArea) {
+        const auto area = Rectangle<int>{{m.x, m.y}, {m.w, m.h}} |
+                          Rectangle<int>{{n.x, n.y}, {n.w, n.h}};
+        m.x = area.pos.x;
+        m.y = area.pos.y;
+        m.w = area.size.x;
+        m.h = area.size.y;
+      } else {
+        m.op = LayerOperation::Draw;
+      }
+      m.ticket = std::max(m.ticket, n.ticket);
+      coalesce_stat.layer_ops++;
+      return true;
+    }
+    return false;
+  }
 }
 
-Task::Task(uint64_t id) : _id{id}, _msgs{} {
+CoalesceStat coalesce_stat;
+
+Task::Task(uint64_t id) : _id{id} {
+}
+
+void* Task::operator new(size_t size){
+  return task_cache.AllocateForNew(size);
+}
+
+void Task::operator delete(void* p){
+  task_cache.Free(p);
 }
 
 
@@ -69,19 +150,35 @@ Task& Task::Wakeup(){
   return *this;
 }
 
-void Task::SendMessage(const Message& msg){
-  _msgs.push_back(msg);
+Error Task::SendMessage(const Message& msg){
+  //a full ring drops msg, still wake the task so that it drains
+  auto err = _msgs.Push(msg);
   Wakeup();
+  return err;
 }
 
 std::optional<Message> Task::ReceiveMessage(){
-  if(_msgs.empty()){
-    return std::nullopt;
+  return _msgs.Pop(CoalesceMessage);
+}
+
+Message Task::WaitMessage(){
+  __asm__("cli");
+  auto msg = ReceiveMessage();
+  while(!msg){
+    wait_stat.waits++;
+    Sleep();
+    __asm__("cli");
+    msg = ReceiveMessage();
+    if(!msg){
+      wait_stat.spurious++;
+    }
   }
+  __asm__("sti");
+  return *msg;
+}
 
-  auto m = _msgs.front();
-  _msgs.pop_front();
-  return m;
+MPSCRing<Message>::Stat Task::MessageStat() const{
+  return _msgs.GetStat();
 }
 
 std::vector<std::shared_ptr<::FileDescriptor>>& Task::Files() {
@@ -116,34 +213,107 @@ std::vector<FileMapping>& Task::FileMaps() {
   return _file_maps;
 }
 
+FaultAround& Task::DPagingFaultAround() {
+  return _fault_around;
+}
+
+Task& Task::SetAffinity(uint32_t cpu_mask) {
+  _affinity = cpu_mask;
+  return *this;
+}
+
+uint64_t Task::PageFaults() const {
+  return _page_faults;
+}
+
+void Task::CountPageFault() {
+  _page_faults++;
+}
+
 TaskManager::TaskManager(){
+  _slots.emplace_back();
+  auto& cpu = _cpus[0];
+  cpu.online = true;
+
   Task& main_task = NewTask()
-      .SetLevel(_current_level)
+      .SetLevel(cpu.current_level)
       .SetReadyOrRunning(true);
   
-  _runnning[_current_level].push_back(&main_task);
+  cpu.running[cpu.current_level].push_back(&main_task);
+  //xHCI interrupts arrive at the BSP
+  main_task.SetAffinity(1u << 0);
+
+  //MP makes WAIT trap with TS too, the main task owns the live FPU state
+  SetCR0((GetCR0() | kCR0MP) & ~kCR0TS);
+  fpu_owner[0] = &main_task;
 
   Task& idle_task = NewTask()
      .InitContext(TaskIdle, 0)
      .SetLevel(0)
-     .SetReadyOrRunning(true);
+     .SetReadyOrRunning(true)
+     .SetAffinity(1u << 0);
 
-  _runnning[0].push_back(&idle_task);
+  cpu.running[0].push_back(&idle_task);
 }
 
 Task& TaskManager::NewTask(){
-  _last_id++;
-  return *_tasks.emplace_back(new Task{_last_id});
+  uint32_t index;
+  if (_free_slots.empty()) {
+    index = _slots.size();
+    _slots.emplace_back();
+  } else {
+    index = _free_slots.back();
+    _free_slots.pop_back();
+  }
+
+  auto& slot = _slots[index];
+  slot.task.reset(new Task{static_cast<uint64_t>(slot.generation) << 32 | index});
+
+  //spread new tasks over the online CPUs, a task stays on its CPU
+  do {
+    _next_cpu = (_next_cpu + 1) % kMaxCPUs;
+  } while (!_cpus[_next_cpu].online);
+  slot.task->_cpu = _next_cpu;
+  return *slot.task;
+}
+
+void TaskManager::InitializeCPU(int cpu_index){
+  auto& cpu = _cpus[cpu_index];
+
+  //the AP startup thread becomes the idle task, its context is saved
+  //at the first switch
+  Task& idle_task = NewTask()
+     .SetLevel(0)
+     .SetReadyOrRunning(true)
+     .SetAffinity(1u << cpu_index);
+  idle_task._cpu = cpu_index;
+
+  cpu.current_level = 0;
+  cpu.running[0].push_back(&idle_task);
+  //the AP starts with CR0.TS clear
+  fpu_owner[cpu_index] = &idle_task;
+  cpu.online = true;
 }
 
 void TaskManager::SwitchTask(const TaskContext& current_ctx){
-  TaskContext& task_ctx = task_manager->CurrentTask().Context();
-  memcpy(&task_ctx, &current_ctx, sizeof(TaskContext));
+  const int cpu_index = CurrentCPU();
+  auto& cpu = _cpus[cpu_index];
+  //the timer runs on its own stack, nothing uses the zombie stack anymore
+  cpu.zombie.reset();
 
-  Task* current_task = RotateCurrentRunQueue(false);
+  TaskContext& task_ctx = CurrentTask().Context();
+  //the interrupt saved the FPU state only when it was live
+  memcpy(&task_ctx, &current_ctx, (current_ctx.cr0_ts & kCR0TS)
+      ? offsetof(TaskContext, fxsave_area) : sizeof(TaskContext));
+
+  Task* current_task = RotateCurrentRunQueue(cpu, false);
 
   if (&CurrentTask() != current_task) {
-    RestoreContext(&CurrentTask().Context());
+    //the interrupt handler may have clobbered the FPU registers
+    if (!(GetCR0() & kCR0TS)) {
+      fpu_owner[cpu_index] = nullptr;
+    }
+    RestoreContext(&PrepareSwitch(CurrentTask()));
   }
 
   // SwitchContext(&next_task->Context(), &current_task->Context());
@@ -167,26 +337,32 @@ void TaskManager::Sleep(Task* task){
   }
   task->SetReadyOrRunning(false);
 
-  if(task == _runnning[_current_level].front()){
+  auto& cpu = _cpus[task->_cpu];
+  if(task == cpu.running[cpu.current_level].front()){
     // SwitchTask(true);
+    if(task->_cpu != CurrentCPU()){
+      //running on another CPU, which drops it at its next switch
+      cpu.level_changed = true;
+      SendRescheduleIPI(task->_cpu);
+      return;
+    }
 
-    Task* current_task = RotateCurrentRunQueue(true);
-    SwitchContext(&CurrentTask().Context(), &current_task->Context());
+    Task* current_task = RotateCurrentRunQueue(cpu, true);
+    SwitchContext(&PrepareSwitch(CurrentTask()), &current_task->Context());
     return;
   }
 
  
-  Erase(_runnning[task->Level()], task);
+  Erase(cpu.running[task->Level()], task);
 }
 
 Error TaskManager::Sleep(uint64_t id){
-  auto iter = std::find_if(_tasks.begin(), _tasks.end(),
-      [id](const auto& t){ return t->ID() == id; });
-  if(iter == _tasks.end()){
+  auto task = FindTask(id);
+  if(task == nullptr){
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Sleep(iter->get());
+  Sleep(task);
   return MAKE_ERROR(Error::kSuccess);
 }
 
@@ -195,58 +371,110 @@ void TaskManager::Wakeup(Task* task, int level){
   // if(iter == _runnning.end()){
   //   _runnning.push_back(task);
   // }
-  if(task->ReadyOrRunning()){
+  if(level >= 0){
+    task->_base_level = level;
+  }
+  level = EffectiveLevel(task);
+
+  auto& task_cpu = _cpus[task->_cpu];
+  //the second case: put to sleep on another CPU, which still runs it
+  if(task->ReadyOrRunning() ||
+     task == task_cpu.running[task_cpu.current_level].front()){
+    task->SetReadyOrRunning(true);
     ChangeLevelRunning(task, level);
     return;
   }
 
-  if(level < 0){
-    level = task->Level();
+  if(!(task->_affinity & (1u << task->_cpu))){
+    for(int i = 0; i < kMaxCPUs; i++){
+      if(_cpus[i].online && (task->_affinity & (1u << i))){
+        Migrate(task, i);
+        break;
+      }
+    }
   }
+  auto& cpu = _cpus[task->_cpu];
+  const bool cpu_idle = cpu.current_level == 0;
 
-  task->SetLevel(level);
+  task->_level = level;
   task->SetReadyOrRunning(true);
 
-  _runnning[level].push_back(task);
-  if(level > _current_level){
-    _level_changed = true;
+  cpu.running[level].push_back(task);
+  //the CPU of the task switches at once only when the task preempts
+  //what runs there. Otherwise the time slice timer of the running task
+  //rotates to it, or an idle CPU takes it
+  if(level > cpu.current_level || cpu_idle){
+    cpu.level_changed = true;
+    SendRescheduleIPI(task->_cpu);
+  }else if(level > 0){
+    //the task waits behind the running one, StealTask can move it
+    for(int i = 0; i < kMaxCPUs; i++){
+      if(i != task->_cpu && _cpus[i].online && _cpus[i].current_level == 0 &&
+         (task->_affinity & (1u << i))){
+        _cpus[i].level_changed = true;
+        SendRescheduleIPI(i);
+        break;
+      }
+    }
   }
 }
 
 Error TaskManager::Wakeup(uint64_t id, int level){
-  auto iter = std::find_if(_tasks.begin(), _tasks.end(),
-      [id](const auto& t){ return t->ID() == id; });
-  if(iter == _tasks.end()){
+  auto task = FindTask(id);
+  if(task == nullptr){
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  Wakeup(iter->get(), level);
+  Wakeup(task, level);
   return MAKE_ERROR(Error::kSuccess);
 }
 
 Error TaskManager::SendMessage(uint64_t id, const Message& msg){
-  auto iter = std::find_if(_tasks.begin(), _tasks.end(),
-      [id](const auto& t){ return t->ID() == id; });
-  if(iter == _tasks.end()){
+  auto task = FindTask(id);
+  if(task == nullptr){
     return MAKE_ERROR(Error::kNoSuchTask);
   }
 
-  iter->get()->SendMessage(msg);
-  return MAKE_ERROR(Error::kSuccess);
+  return task->SendMessage(msg);
+}
+
+bool TaskManager::LevelChanged(){
+  return _cpus[CurrentCPU()].level_changed;
+}
+
+bool TaskManager::TimeSliceNeeded(){
+  const auto& cpu = _cpus[CurrentCPU()];
+  size_t tasks = 0;
+  for(int lv = 1; lv <= kMaxLevel; lv++){
+    tasks += cpu.running[lv].size();
+  }
+  return tasks > 0;
 }
 
 Task& TaskManager::CurrentTask(){
-  return *_runnning[_current_level].front();
+  auto& cpu = _cpus[CurrentCPU()];
+  return *cpu.running[cpu.current_level].front();
 }
 
 void TaskManager::Finish(int exit_code){
-  Task* current_task = RotateCurrentRunQueue(true);
+  const int cpu_index = CurrentCPU();
+  auto& cpu = _cpus[cpu_index];
+  Task* current_task = RotateCurrentRunQueue(cpu, true);
 
   const auto task_id = current_task->ID();
-  auto it = std::find_if(
-      _tasks.begin(), _tasks.end(),
-      [current_task](const auto& t){ return t.get() == current_task; });
-  _tasks.erase(it);
+  if (fpu_owner[cpu_index] == current_task) {
+    fpu_owner[cpu_index] = nullptr;
+  }
+  ReturnPriority(current_task);
+  for (auto lender : current_task->_lenders) {
+    lender->_waits_for = nullptr;
+  }
+  Erase(_deadline_tasks, current_task);
+  const uint32_t index = task_id & 0xffffffffu;
+  //this still runs on the stack of the task, free it after the switch
+  cpu.zombie = std::move(_slots[index].task);
+  _slots[index].generation++;
+  _free_slots.push_back(index);
 
   _finish_tasks[task_id] = exit_code;
   auto iter = _finish_waiter.find(task_id); 
@@ -256,7 +484,7 @@ void TaskManager::Finish(int exit_code){
     Wakeup(waiter);
   }
 
-  RestoreContext(&CurrentTask().Context());
+  RestoreContext(&PrepareSwitch(CurrentTask()));
 }
 
 WithError<int> TaskManager::WaitFinish(uint64_t task_id){
@@ -277,35 +505,52 @@ WithError<int> TaskManager::WaitFinish(uint64_t task_id){
   return { exit_code, MAKE_ERROR(Error::kSuccess) };
 }
 
+Task* TaskManager::FindTask(uint64_t id){
+  const uint64_t index = id & 0xffffffffu;
+  if(index == 0 || index >= _slots.size()){
+    return nullptr;
+  }
+
+  auto& slot = _slots[index];
+  if(!slot.task || slot.generation != id >> 32){
+    return nullptr;
+  }
+  return slot.task.get();
+}
+
 void TaskManager::ChangeLevelRunning(Task* task, int level){
   if(level < 0 || level == task->Level()){
     return;
   }
 
-  if(task != _runnning[_current_level].front()){
-    Erase(_runnning[task->Level()], task);
-    _runnning[level].push_back(task);
+  auto& cpu = _cpus[task->_cpu];
+  if(task != cpu.running[cpu.current_level].front()){
+    Erase(cpu.running[task->Level()], task);
+    cpu.running[level].push_back(task);
   
-    task->SetLevel(level);
-    if(level > _current_level){
-      _level_changed = true;
+    task->_level = level;
+    if(level > cpu.current_level){
+      cpu.level_changed = true;
+      SendRescheduleIPI(task->_cpu);
     }
+    return;
   }
 
-  //change self
-  _runnning[_current_level].pop_front();
-  _runnning[level].push_front(task);
+  //change self, or the task another CPU is running
+  cpu.running[cpu.current_level].pop_front();
+  cpu.running[level].push_front(task);
 
-  task->SetLevel(level);
-  if(level>= _current_level){
-    _current_level = level;
+  task->_level = level;
+  if(level>= cpu.current_level){
+    cpu.current_level = level;
   }else{
-    _current_level = level;
-    _level_changed = true;
+    cpu.current_level = level;
+    cpu.level_changed = true;
+    SendRescheduleIPI(task->_cpu);
   }
 }
 
-Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
+Task* TaskManager::RotateCurrentRunQueue(CPUQueues& cpu, bool current_sleep) {
   // size_t next_task_index = _current_task_index + 1;
   // if(next_task_index>=_tasks.size()){
   //   next_task_index = 0;
@@ -316,45 +561,268 @@ Task* TaskManager::RotateCurrentRunQueue(bool current_sleep) {
 
   // _current_task_index = next_task_index;
 
-  auto current_level_queue = &_runnning[_current_level];
-  Task* current_task = current_level_queue->front();
+  const int cpu_index = &cpu - _cpus.data();
+  const auto now = timer_manager->CurrentTick();
+  Task* current_task = cpu.running[cpu.current_level].front();
+  if(current_task->_dl_runtime > 0){
+    current_task->_dl_budget -= now - cpu.switched_at;
+  }
+  cpu.switched_at = now;
+  ReplenishDeadlines(cpu_index, now);
+
+  auto current_level_queue = &cpu.running[cpu.current_level];
   current_level_queue->pop_front();
-  if(!current_sleep){
-    current_level_queue->push_back(current_task);
+  if(current_task->_dl_runtime > 0 && !current_task->_dl_throttled &&
+     current_task->_dl_budget <= 0){
+    current_task->_dl_throttled = true;
+    current_task->_dl_throttles++;
+    current_task->_level = EffectiveLevel(current_task);
+    cpu.level_changed = true;
+  }
+  //a task put to sleep by another CPU is still at the front
+  if(!current_sleep && current_task->ReadyOrRunning()){
+    cpu.running[current_task->Level()].push_back(current_task);
   }
 
   if(current_level_queue->empty()){
-    _level_changed = true;
+    cpu.level_changed = true;
   }
 
-  if(_level_changed){
-    _level_changed = false;
+  if(cpu.level_changed){
+    cpu.level_changed = false;
     for(int lv = kMaxLevel; lv>= 0; lv--){
-      if(!_runnning[lv].empty()){
-        _current_level = lv;
-        current_level_queue = &_runnning[_current_level];
+      if(!cpu.running[lv].empty()){
+        cpu.current_level = lv;
+        current_level_queue = &cpu.running[cpu.current_level];
         break;
       }
     }
   }
 
+  //only the idle task is left, take work from a busy CPU
+  if(cpu.current_level == 0){
+    if(const int lv = StealTask(cpu); lv > 0){
+      cpu.current_level = lv;
+      current_level_queue = &cpu.running[cpu.current_level];
+    }
+  }
+
+  //earliest deadline first at the top level, other tasks take turns
+  //once no deadline task is left
+  if(cpu.current_level == kMaxLevel){
+    const auto key = [](const Task* t){
+      return t->_dl_runtime > 0 && !t->_dl_throttled
+          ? t->_dl_deadline : std::numeric_limits<unsigned long>::max();
+    };
+    auto earliest = std::min_element(current_level_queue->begin(), current_level_queue->end(),
+        [&key](const Task* a, const Task* b){ return key(a) < key(b); });
+    if(earliest != current_level_queue->begin() &&
+       key(*earliest) != std::numeric_limits<unsigned long>::max()){
+      Task* task = *earliest;
+      current_level_queue->erase(earliest);
+      current_level_queue->push_front(task);
+    }
+  }
+
   // Task* next_task = current_level_queue->front();
 
+  //the next task may need the timer sooner, for its slice or its runtime
+  RearmLAPICTimer();
   return current_task;
 }
 
+int TaskManager::EffectiveLevel(const Task* task) const{
+  int level = task->_dl_runtime > 0 && !task->_dl_throttled
+      ? kMaxLevel : task->_base_level;
+  for(auto lender : task->_lenders){
+    level = std::max(level, lender->Level());
+  }
+  return level;
+}
+
+void TaskManager::UpdateLevel(Task* task){
+  //bounded in case waiters form a cycle
+  for(int i = 0; task != nullptr && i <= kMaxLevel; i++){
+    const int level = EffectiveLevel(task);
+    if(level == task->Level()){
+      return;
+    }
+    auto& cpu = _cpus[task->_cpu];
+    if(task->ReadyOrRunning() ||
+       task == cpu.running[cpu.current_level].front()){
+      ChangeLevelRunning(task, level);
+    }else{
+      task->_level = level;
+    }
+    task = task->_waits_for;
+  }
+}
+
+void TaskManager::ReplenishDeadlines(int cpu_index, unsigned long now){
+  for(auto task : _deadline_tasks){
+    if(task->_cpu != cpu_index || now < task->_dl_deadline){
+      continue;
+    }
+    //keep the period grid unless the task fell behind by a whole period
+    task->_dl_deadline += task->_dl_period;
+    if(task->_dl_deadline <= now){
+      task->_dl_deadline = now + task->_dl_period;
+    }
+    task->_dl_budget = task->_dl_runtime;
+    if(task->_dl_throttled){
+      task->_dl_throttled = false;
+      UpdateLevel(task);
+    }
+  }
+}
+
+Error TaskManager::SetDeadline(uint64_t id, unsigned long runtime, unsigned long period){
+  auto task = FindTask(id);
+  if(task == nullptr){
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  Erase(_deadline_tasks, task);
+  if(runtime > 0){
+    _deadline_tasks.push_back(task);
+  }
+  const auto now = timer_manager->CurrentTick();
+  task->_dl_runtime = std::min(runtime, period);
+  task->_dl_period = period;
+  task->_dl_deadline = now + period;
+  task->_dl_budget = task->_dl_runtime;
+  task->_dl_throttled = false;
+  task->_base_level = Task::kDefaultLevel;
+
+  //the runtime counts from here if the task is running
+  auto& cpu = _cpus[task->_cpu];
+  if(task == cpu.running[cpu.current_level].front()){
+    cpu.switched_at = now;
+  }
+  UpdateLevel(task);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+unsigned long TaskManager::NextDeadlineEvent(){
+  const int cpu_index = CurrentCPU();
+  const auto& cpu = _cpus[cpu_index];
+  unsigned long next = std::numeric_limits<unsigned long>::max();
+  for(auto task : _deadline_tasks){
+    if(task->_cpu == cpu_index && task->_dl_throttled){
+      next = std::min(next, task->_dl_deadline);
+    }
+  }
+  const Task* current_task = cpu.running[cpu.current_level].front();
+  if(current_task->_dl_runtime > 0 && !current_task->_dl_throttled){
+    next = std::min(next, cpu.switched_at + std::max(current_task->_dl_budget, 0l));
+  }
+  return next;
+}
+
+Error TaskManager::LendPriority(Task* task, uint64_t holder_id){
+  auto holder = FindTask(holder_id);
+  if(holder == nullptr){
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  ReturnPriority(task);
+  task->_waits_for = holder;
+  holder->_lenders.push_back(task);
+  UpdateLevel(holder);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::ReturnPriority(Task* task){
+  auto holder = task->_waits_for;
+  if(holder == nullptr){
+    return;
+  }
+  task->_waits_for = nullptr;
+  Erase(holder->_lenders, task);
+  UpdateLevel(holder);
+}
+
+Error TaskManager::ReturnPriority(uint64_t id){
+  auto task = FindTask(id);
+  if(task == nullptr){
+    return MAKE_ERROR(Error::kNoSuchTask);
+  }
+
+  ReturnPriority(task);
+  return MAKE_ERROR(Error::kSuccess);
+}
+
+void TaskManager::Migrate(Task* task, int cpu_index){
+  //the old CPU may still hold the FPU state, the context has a copy
+  auto& owner = fpu_owner[task->_cpu];
+  if (owner == task) {
+    owner = nullptr;
+  }
+  ForgetPCID(task->Context().cr3, cpu_index);
+  task->_cpu = cpu_index;
+}
+
+//moves the last waiting task of the busiest CPU at the highest level to
+//thief. Returns the level, 0 if there was nothing to take
+int TaskManager::StealTask(CPUQueues& thief){
+  const int thief_index = &thief - _cpus.data();
+  for(int lv = kMaxLevel; lv > 0; lv--){
+    CPUQueues* victim = nullptr;
+    size_t victim_waiting = 0;
+    for(auto& cpu : _cpus){
+      //the front of the current level is running
+      const size_t running = lv == cpu.current_level ? 1 : 0;
+      if(&cpu == &thief || !cpu.online || cpu.running[lv].size() <= running){
+        continue;
+      }
+      if(cpu.running[lv].size() - running > victim_waiting){
+        victim = &cpu;
+        victim_waiting = cpu.running[lv].size() - running;
+      }
+    }
+    if(victim == nullptr){
+      continue;
+    }
+
+    auto& queue = victim->running[lv];
+    const size_t first = queue.size() - victim_waiting;
+    for(size_t i = queue.size(); i-- > first;){
+      Task* task = queue[i];
+      if(!(task->_affinity & (1u << thief_index))){
+        continue;
+      }
+      queue.erase(queue.begin() + i);
+      Migrate(task, thief_index);
+      thief.running[lv].push_back(task);
+      _steals++;
+      return lv;
+    }
+  }
+  return 0;
+}
+
 TaskManager* task_manager;
 
 void InitializeTask() {
   task_manager = new TaskManager;
-
-  __asm__("cli");
-  timer_manager->AddTimer(
-      Timer{timer_manager->CurrentTick() + kTaskTimerPeriod, kTaskTimerValue, 1});
-  __asm__("sti");
 }
 
 __attribute__((no_caller_saved_registers))
 extern "C" uint64_t GetCurrentTaskOSStackPointer() {
   return task_manager->CurrentTask().OSStackPointer();
-}
\ No newline at end of file
+}
+
+__attribute__((no_caller_saved_registers))
+extern "C" void* ClaimFPU() {
+  //#NM from user mode comes without the kernel lock
+  KernelLockGuard lock;
+  auto& owner = fpu_owner[CurrentCPU()];
+  owner = &task_manager->CurrentTask();
+  return owner->Context().fxsave_area.data();
+}
+
+__attribute__((no_caller_saved_registers))
+extern "C" void ReleaseFPU() {
+  fpu_owner[CurrentCPU()] = nullptr;
+  SetCR0(GetCR0() | kCR0TS);
+}
@@ -11,9 +11,12 @@
 #include "error.hpp"
 #include "message.hpp"
 #include "fat.hpp"
+#include "slab.hpp"
+#include "queue.hpp"
+#include "smp.hpp"
 
 struct TaskContext {
-  uint64_t cr3, rip, rflags, reserved1; // offset 0x00
+  uint64_t cr3, rip, rflags, cr0_ts; // offset 0x00
   uint64_t cs, ss, fs, gs; // offset 0x20
   uint64_t rax, rbx, rcx, rdx, rdi, rsi, rsp, rbp; // offset 0x40
   uint64_t r8, r9, r10, r11, r12, r13, r14, r15; // offset 0x80
@@ -22,27 +25,51 @@ struct TaskContext {
 
 using TaskFunc = void (uint64_t, int64_t);
 
+//messages that Task::ReceiveMessage folded into the one before them
+struct CoalesceStat {
+  uint64_t mouse_moves, layer_ops;
+};
+
+extern CoalesceStat coalesce_stat;
+
 class TaskManager;
 
 struct FileMapping {
   int fd;
   uint64_t vaddr_begin, vaddr_end;
+  //read-ahead window, grows while faults are sequential
+  size_t readahead_pages{0};
+  uint64_t next_fault{0};
+};
+
+//adaptive fault-around of demand paging, enabled by SyscallDemandPages
+struct FaultAround {
+  bool enabled;
+  size_t window_pages;
+  //end of the pages mapped by the last fault
+  uint64_t last_end;
 };
 
 class Task{
   public:
     static const int kDefaultLevel = 1;
     static const size_t kDefaultStackBytes = 4096 * 16;
+    static const size_t kMessageCapacity = 256;
 
     Task(uint64_t id);
+    static void* operator new(size_t size);
+    static void operator delete(void* p);
     Task& InitContext(TaskFunc* f, int64_t data);
     TaskContext& Context();
     uint64_t& OSStackPointer();
     uint64_t ID() const;
     Task& Sleep();
     Task& Wakeup();
-    void SendMessage(const Message& msg);
+    Error SendMessage(const Message& msg);
     std::optional<Message> ReceiveMessage();
+    //sleeps until a message arrives, returns with interrupts enabled
+    Message WaitMessage();
+    MPSCRing<Message>::Stat MessageStat() const;
     std::vector<std::shared_ptr<::FileDescriptor>>& Files();
     uint64_t DPagingBegin() const;
     void SetDPagingBegin(uint64_t v);
@@ -51,24 +78,53 @@ class Task{
     uint64_t FileMapEnd() const;
     void SetFileMapEnd(uint64_t v);
     std::vector<FileMapping>& FileMaps();
+    FaultAround& DPagingFaultAround();
+    uint64_t PageFaults() const;
+    void CountPageFault();
 
     int Level() const { return _level; }
     bool ReadyOrRunning() const { return _ready_or_running;}
+    int CPU() const { return _cpu; }
+    //CPUs the task should run on, bit n: CPU n. Wakeup moves the task
+    //into the set and the balancer only moves it within
+    Task& SetAffinity(uint32_t cpu_mask);
+    uint32_t Affinity() const { return _affinity; }
+    //the task used up the runtime of its deadline period
+    bool Throttled() const { return _dl_throttled; }
+    uint64_t Throttles() const { return _dl_throttles; }
   private:
     uint64_t _id;
     std::vector<uint64_t> _stack;
     alignas(16) TaskContext _context;
     uint64_t _os_stack_ptr;
-    std::deque<Message> _msgs;
+    MPSCRing<Message> _msgs{kMessageCapacity};
     unsigned int _level{kDefaultLevel};
+    //level without the deadline class and lent priority
+    unsigned int _base_level{kDefaultLevel};
     bool _ready_or_running{false};
+    int _cpu{0};
+    uint32_t _affinity{~0u};
     std::vector<std::shared_ptr<::FileDescriptor>> _files{};
     uint64_t _dpaging_begin{0}, _dpaging_end{0};
     uint64_t _file_map_end{0};
     std::vector<FileMapping> _file_maps{};
+    FaultAround _fault_around{false, 1, 0};
+    uint64_t _page_faults{0};
+    //deadline class, see TaskManager::SetDeadline. Ticks
+    unsigned long _dl_runtime{0}, _dl_period{0};
+    //end of the current period, and the runtime left in it
+    unsigned long _dl_deadline{0};
+    long _dl_budget{0};
+    bool _dl_throttled{false};
+    uint64_t _dl_throttles{0};
+    //priority inheritance: the task this one waits for a reply from,
+    //and the tasks waiting for this one
+    Task* _waits_for{nullptr};
+    std::vector<Task*> _lenders{};
 
     Task& SetLevel(int level){ 
       _level = level;
+      _base_level = level;
       return *this;
     }
      Task& SetReadyOrRunning(int ready_or_running){ 
@@ -86,6 +142,8 @@ class TaskManager{
 
     TaskManager();
     Task& NewTask();
+    //registers the startup thread of an AP as the idle task of the CPU
+    void InitializeCPU(int cpu_index);
     void SwitchTask(const TaskContext& current_ctx);
 
     void Sleep(Task* task);
@@ -94,22 +152,81 @@ class TaskManager{
     Error Wakeup(uint64_t id, int level = -1);
     Error SendMessage(uint64_t id, const Message& msg);
     Task& CurrentTask();
+    //a task of a higher level woke up on this CPU since the last switch
+    bool LevelChanged();
+    //a task other than the idle task runs on this CPU. Its timer keeps
+    //ending time slices, which also lets other CPUs take the kernel lock
+    bool TimeSliceNeeded();
     void Finish(int exit_code);
     WithError<int> WaitFinish(uint64_t task_id);
 
+    //tasks idle CPUs took from busy ones
+    uint64_t Steals() const { return _steals; }
+
+    //deadline class: the task runs at kMaxLevel for runtime ticks of
+    //each period, earliest deadline first among such tasks. Once it used
+    //them up it runs at Task::kDefaultLevel until the next period.
+    //runtime 0 takes the task out of the class
+    Error SetDeadline(uint64_t id, unsigned long runtime, unsigned long period);
+    //tick at which the deadline class next needs a switch on this CPU
+    unsigned long NextDeadlineEvent();
+
+    //task waits for a reply from holder_id, which runs at least at the
+    //level of task until ReturnPriority
+    Error LendPriority(Task* task, uint64_t holder_id);
+    void ReturnPriority(Task* task);
+    Error ReturnPriority(uint64_t id);
+
+    template <class F>
+    void ForEachTask(F f) {
+      for (auto& slot : _slots) {
+        if (slot.task) {
+          f(*slot.task);
+        }
+      }
+    }
+
   private:
-    std::vector<std::unique_ptr<Task>> _tasks{};
-    uint64_t _last_id{0};
+    //task ID: generation << 32 | slot index, slot 0 is never used.
+    //a finished task frees its slot, the next user gets a new generation
+    struct TaskSlot {
+      std::unique_ptr<Task> task;
+      uint32_t generation;
+    };
+    std::vector<TaskSlot> _slots{};
+    std::vector<uint32_t> _free_slots{};
     // size_t _current_task_index{0};
-    std::array<std::deque<Task*>, kMaxLevel + 1> _runnning{};
-    int _current_level{kMaxLevel};
-    bool _level_changed{false};
+    //run queues of one CPU. Other CPUs may wake tasks into them,
+    //the kernel lock serializes all accesses
+    struct CPUQueues {
+      std::array<std::deque<Task*>, kMaxLevel + 1> running{};
+      int current_level{kMaxLevel};
+      bool level_changed{false};
+      bool online{false};
+      //finished task, freed once the CPU no longer runs on its stack
+      std::unique_ptr<Task> zombie{};
+      //tick the running task got the CPU
+      unsigned long switched_at{0};
+    };
+    std::array<CPUQueues, kMaxCPUs> _cpus{};
+    int _next_cpu{0};
+    uint64_t _steals{0};
+    std::vector<Task*> _deadline_tasks{};
      // key: ID of a finished task
-    std::map<uint64_t, int> _finish_tasks{};
-    std::map<uint64_t, Task*> _finish_waiter{};
+    std::map<uint64_t, int, std::less<uint64_t>,
+             SlabAllocator<std::pair<const uint64_t, int>>> _finish_tasks{};
+    std::map<uint64_t, Task*, std::less<uint64_t>,
+             SlabAllocator<std::pair<const uint64_t, Task*>>> _finish_waiter{};
 
+    Task* FindTask(uint64_t id);
     void ChangeLevelRunning(Task* task, int level);
-    Task* RotateCurrentRunQueue(bool current_sleep);
+    int EffectiveLevel(const Task* task) const;
+    //moves the task to its EffectiveLevel, and on along the tasks it waits for
+    void UpdateLevel(Task* task);
+    void ReplenishDeadlines(int cpu_index, unsigned long now);
+    Task* RotateCurrentRunQueue(CPUQueues& cpu, bool current_sleep);
+    void Migrate(Task* task, int cpu_index);
+    int StealTask(CPUQueues& thief);
 };
 
 extern TaskManager* task_manager;
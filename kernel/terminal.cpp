@@ -10,11 +10,14 @@
 #include "usb/xhci/xhci.hpp"
 #include "elf.hpp"
 #include "memory_manager.hpp"
+#include "slab.hpp"
 #include "paging.hpp"
+#include "page_cache.hpp"
 #include "asmfunc.h"
 #include "timer.hpp"
 #include "uefi.h"
 #include "keyboard.hpp"
+#include "smp.hpp"
 
 
 namespace {
@@ -129,21 +132,27 @@ namespace {
       return pml4;
     }
 
-    const auto current_pml4 = reinterpret_cast<PageMapEntry*>(GetCR3());
+    const auto current_pml4 = CurrentPML4();
     memcpy(pml4.value, current_pml4, 256 * sizeof(uint64_t));
 
-    const auto cr3 = reinterpret_cast<uint64_t>(pml4.value);
+    //keep the PCID of the task, the CR3 write below flushes its entries
+    auto pcid = current_task.Context().cr3 & kCR3PCIDMask;
+    if (pcid == 0) {
+      pcid = AllocatePCID();
+    }
+    const auto cr3 = reinterpret_cast<uint64_t>(pml4.value) | pcid;
     SetCR3(cr3);
     current_task.Context().cr3 = cr3;
     return pml4;
   }
 
   Error FreePML4(Task& current_task) {
-    const auto cr3 = current_task.Context().cr3;
+    const auto cr3 = current_task.Context().cr3 & ~kCR3NoFlush;
     current_task.Context().cr3 = 0;
     ResetCR3();
 
-    return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3));
+    FreePCID(cr3 & kCR3PCIDMask);
+    return FreePageMap(reinterpret_cast<PageMapEntry*>(cr3 & ~kCR3PCIDMask));
   }
 
   // void ListAllEntries(Terminal* term, uint32_t dir_cluster) {
@@ -336,6 +345,210 @@ namespace {
     return FindCommand(command, apps_entry.first->FirstCluster());
   }
 
+  //context switch benchmark: two tasks bounce messages until end_tick
+  struct PingPongArgs {
+    uint64_t peer_id;
+    unsigned long end_tick;
+    //each task runs on its own pml4 like an app
+    bool own_pml4;
+  };
+
+  Message ReceivePingPong(Task& task) {
+    while (true) {
+      const auto msg = task.WaitMessage();
+      if (msg.type == Message::kPingPong) {
+        return msg;
+      }
+    }
+  }
+
+  void SendPingPong(uint64_t task_id, uint64_t peer_id, int stop) {
+    Message msg{Message::kPingPong, task_id};
+    msg.arg.ping_pong.stop = stop;
+    __asm__("cli");
+    task_manager->SendMessage(peer_id, msg);
+    __asm__("sti");
+  }
+
+  void FinishPingPong(Task& task, bool own_pml4, int exit_code) {
+    __asm__("cli");
+    if (own_pml4) {
+      FreePML4(task);
+    }
+    task_manager->Finish(exit_code);
+  }
+
+  void TaskPing(uint64_t task_id, int64_t data) {
+    const auto args = reinterpret_cast<PingPongArgs*>(data);
+    __asm__("cli");
+    Task& task = task_manager->CurrentTask();
+    __asm__("sti");
+    if (args->own_pml4) {
+      SetupPML4(task);
+    }
+
+    int round_trips = 0;
+    while (timer_manager->CurrentTick() < args->end_tick) {
+      SendPingPong(task_id, args->peer_id, 0);
+      ReceivePingPong(task);
+      round_trips++;
+    }
+    SendPingPong(task_id, args->peer_id, 1);
+    FinishPingPong(task, args->own_pml4, round_trips);
+  }
+
+  void TaskPong(uint64_t task_id, int64_t data) {
+    const auto args = reinterpret_cast<PingPongArgs*>(data);
+    __asm__("cli");
+    Task& task = task_manager->CurrentTask();
+    __asm__("sti");
+    if (args->own_pml4) {
+      SetupPML4(task);
+    }
+
+    while (true) {
+      const auto msg = ReceivePingPong(task);
+      if (msg.arg.ping_pong.stop) {
+        break;
+      }
+      SendPingPong(task_id, msg.src_task_id, 0);
+    }
+    FinishPingPong(task, args->own_pml4, 0);
+  }
+
+  //returns task switches per second
+  uint64_t RunPingPong(bool own_pml4, int seconds) {
+    PingPongArgs pong_args{0, 0, own_pml4};
+    auto& pong = task_manager->NewTask()
+      .InitContext(TaskPong, reinterpret_cast<int64_t>(&pong_args));
+    PingPongArgs ping_args{pong.ID(),
+      timer_manager->CurrentTick() + seconds * kTimerFreq, own_pml4};
+    auto& ping = task_manager->NewTask()
+      .InitContext(TaskPing, reinterpret_cast<int64_t>(&ping_args));
+    const auto ping_id = ping.ID(), pong_id = pong.ID();
+    pong.Wakeup();
+    ping.Wakeup();
+
+    __asm__("cli");
+    auto [round_trips, err] = task_manager->WaitFinish(ping_id);
+    task_manager->WaitFinish(pong_id);
+    __asm__("sti");
+    return 2ul * round_trips / seconds;
+  }
+
+  //message delivery stress: receivers drain kPingPong messages until stopped
+  void TaskReceiver(uint64_t task_id, int64_t data) {
+    __asm__("cli");
+    Task& task = task_manager->CurrentTask();
+    __asm__("sti");
+
+    while (!ReceivePingPong(task).arg.ping_pong.stop) {
+    }
+    __asm__("cli");
+    task_manager->Finish(0);
+  }
+
+  //returns messages sent per second, round robin over receivers
+  uint64_t SendToReceivers(uint64_t task_id,
+                           const std::vector<uint64_t>& receivers) {
+    const unsigned long ticks = kTimerFreq / 4;
+    const auto end_tick = timer_manager->CurrentTick() + ticks;
+    uint64_t sent = 0;
+    while (timer_manager->CurrentTick() < end_tick) {
+      for (auto id : receivers) {
+        SendPingPong(task_id, id, 0);
+      }
+      sent += receivers.size();
+    }
+    return sent * kTimerFreq / ticks;
+  }
+
+  struct StarsArgs {
+    unsigned long end_tick;
+    uint64_t stars;
+    std::array<uint8_t, 100 * 100> canvas;
+  };
+
+  //stars-like CPU-bound task: plots random stars into its own canvas.
+  //Plotting touches no kernel state, it runs without the kernel lock
+  void TaskStars(uint64_t task_id, int64_t data) {
+    const auto args = reinterpret_cast<StarsArgs*>(data);
+    const int kStarsPerRound = 4096;
+    uint32_t seed = task_id | 1;
+    uint64_t stars = 0;
+
+    while (timer_manager->CurrentTick() < args->end_tick) {
+      ReleaseKernelLock();
+      for (int i = 0; i < kStarsPerRound; ++i) {
+        //xorshift32
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        args->canvas[seed % args->canvas.size()] ^= 0xff;
+      }
+      AcquireKernelLock();
+      stars += kStarsPerRound;
+    }
+    args->stars = stars;
+
+    __asm__("cli");
+    task_manager->Finish(0);
+  }
+
+  //returns stars per second of tasks allowed on the first cpus CPUs
+  uint64_t RunStars(int num_tasks, int cpus) {
+    const unsigned long ticks = kTimerFreq;
+    std::vector<StarsArgs> args(num_tasks);
+    std::vector<uint64_t> ids;
+    const auto end_tick = timer_manager->CurrentTick() + ticks;
+    for (auto& a : args) {
+      a.end_tick = end_tick;
+      auto& task = task_manager->NewTask()
+        .InitContext(TaskStars, reinterpret_cast<int64_t>(&a))
+        .SetAffinity((1u << cpus) - 1);
+      ids.push_back(task.ID());
+      task.Wakeup();
+    }
+
+    __asm__("cli");
+    for (auto id : ids) {
+      task_manager->WaitFinish(id);
+    }
+    __asm__("sti");
+
+    uint64_t stars = 0;
+    for (const auto& a : args) {
+      stars += a.stars;
+    }
+    return stars * kTimerFreq / ticks;
+  }
+
+  struct DragResult {
+    uint64_t frame_ns, pixels, layer_pixels;
+  };
+
+  //moves the layer one step per frame and composites each frame at once.
+  //Returns averages per frame
+  DragResult RunDrag(unsigned int layer_id, int steps, bool culling) {
+    const bool saved_culling = occlusion_culling;
+    occlusion_culling = culling;
+    uint64_t frame_ns = 0, pixels = 0, layer_pixels = 0;
+    for (int i = 0; i < steps; ++i) {
+      const int x = i % 100;
+      __asm__("cli");
+      const auto stat = compositor_stat;
+      const auto start = MonotonicNanoseconds();
+      layer_manager->Move(layer_id, {40 + x * 6, 40 + x * 3});
+      layer_manager->Composite();
+      frame_ns += MonotonicNanoseconds() - start;
+      pixels += compositor_stat.pixels - stat.pixels;
+      layer_pixels += compositor_stat.layer_pixels - stat.layer_pixels;
+      __asm__("sti");
+    }
+    occlusion_culling = saved_culling;
+    return {frame_ns / steps, pixels / steps, layer_pixels / steps};
+  }
+
 }// namespace
 
 std::map<fat32::DirectoryEntry*, AppLoadInfo>* app_loads;
@@ -509,7 +722,7 @@ void Terminal::ExecuteLine(){
     }
 
     auto& subtask = task_manager->NewTask();
-    pipe_fd = std::make_shared<PipeDescriptor>(subtask);
+    pipe_fd = std::make_shared<PipeDescriptor>();
     auto term_desc = new TerminalDescriptor{
       subcommand, true, false,
       { pipe_fd, _files[1], _files[2] }
@@ -701,6 +914,261 @@ void Terminal::ExecuteLine(){
         p_stat.total_frames,
         p_stat.total_frames * kBytesPerFrame / 1024 / 1024);
 
+    PrintToFD(*_files[1], "Phys boot : %lu frames (%llu MiB)\n",
+        boot_memory_stat.allocated_frames,
+        boot_memory_stat.allocated_frames * kBytesPerFrame / 1024 / 1024);
+
+    const auto h_stat = KernelHeapStat();
+    PrintToFD(*_files[1], "Heap used : %lu KiB (mapped %lu KiB, peak %lu KiB)\n",
+        h_stat.used_bytes / 1024, h_stat.mapped_bytes / 1024,
+        h_stat.peak_bytes / 1024);
+
+    PrintToFD(*_files[1], "Page fault: %lu (last app %lu, mapped 4K %lu, 2M %lu)\n",
+        paging_stat.page_faults, _last_page_faults,
+        paging_stat.mapped_4k_pages, paging_stat.mapped_2m_pages);
+
+    PrintToFD(*_files[1], "COW fault : %lu copied, %lu reused\n",
+        paging_stat.cow_copies, paging_stat.cow_reuses);
+
+    const auto c_stat = page_cache->Stat();
+    PrintToFD(*_files[1], "Page cache: %lu pages (hit %lu, miss %lu)\n",
+        c_stat.cached_pages, c_stat.hits, c_stat.misses);
+
+    PrintToFD(*_files[1], "Slab cache  obj_bytes    used   total  frames\n");
+    for (auto cache = SlabCache::First(); cache; cache = cache->Next()) {
+      const auto s_stat = cache->Stat();
+      PrintToFD(*_files[1], "%-10s %10lu %7lu %7lu %7lu\n",
+          s_stat.name, s_stat.object_bytes, s_stat.used_objects,
+          s_stat.total_objects, s_stat.slab_frames);
+    }
+
+  }else if(strcmp(command, "pingpong") == 0){
+    const int seconds = arg ? std::max(atoi(arg), 1) : 1;
+    PrintToFD(*_files[1], "own pml4   : %lu switches/s\n", RunPingPong(true, seconds));
+    PrintToFD(*_files[1], "shared pml4: %lu switches/s\n", RunPingPong(false, seconds));
+  }else if(strcmp(command, "taskstress") == 0){
+    const int max_tasks = arg ? std::max(atoi(arg), 1) : 256;
+    std::vector<uint64_t> receivers;
+    PrintToFD(*_files[1], "tasks    messages/s\n");
+    for (int tasks = 1; ; tasks = std::min(tasks * 2, max_tasks)) {
+      while (receivers.size() < tasks) {
+        auto& receiver = task_manager->NewTask().InitContext(TaskReceiver, 0);
+        receivers.push_back(receiver.ID());
+        receiver.Wakeup();
+      }
+      PrintToFD(*_files[1], "%5d %13lu\n",
+          tasks, SendToReceivers(_task.ID(), receivers));
+      if (tasks == max_tasks) {
+        break;
+      }
+    }
+
+    for (auto id : receivers) {
+      SendPingPong(_task.ID(), id, 1);
+    }
+    __asm__("cli");
+    for (auto id : receivers) {
+      task_manager->WaitFinish(id);
+    }
+    __asm__("sti");
+  }else if(strcmp(command, "starsbench") == 0){
+    const int tasks = arg ? std::max(atoi(arg), 1) : 8;
+    PrintToFD(*_files[1], "cpus  kstars/s  speedup  steals\n");
+    uint64_t base = 0;
+    for (int cpus = 1; cpus <= CPUCount(); ++cpus) {
+      const auto steals = task_manager->Steals();
+      const auto rate = RunStars(tasks, cpus);
+      if (cpus == 1) {
+        base = std::max<uint64_t>(rate, 1);
+      }
+      const auto speedup = rate * 100 / base;
+      PrintToFD(*_files[1], "%4d %9lu %5lu.%02lu %7lu\n", cpus, rate / 1000,
+          speedup / 100, speedup % 100, task_manager->Steals() - steals);
+    }
+  }else if(strcmp(command, "dragbench") == 0){
+    //drags a window over a stack of ten terminal windows
+    const int steps = arg ? std::max(atoi(arg), 1) : 100;
+    const auto prev_active = active_layer->GetActive();
+    std::vector<unsigned int> ids;
+    for (int i = 0; i < 10; ++i) {
+      auto window = std::make_shared<ToplevelWindow>(
+          kColumns * 8 + 8 + ToplevelWindow::kMarginX,
+          kRows * 16 + 8 + ToplevelWindow::kMarginY,
+          screen_frame_buffer_config.pixel_format, "dragbench");
+      DrawTerminal(*window->InnerWriter(), {0, 0}, window->InnerSize());
+      ids.push_back(layer_manager->NewLayer()
+          .SetWindow(window)
+          .SetTransparentable(true)
+          .Move({100 + i * 24, 60 + i * 24})
+          .ID());
+    }
+    auto drag_window = std::make_shared<ToplevelWindow>(
+        200, 120, screen_frame_buffer_config.pixel_format, "drag");
+    ids.push_back(layer_manager->NewLayer().SetWindow(drag_window).ID());
+    __asm__("cli");
+    for (auto id : ids) {
+      active_layer->Activate(id);
+    }
+    __asm__("sti");
+
+    PrintToFD(*_files[1], "culling  us/frame  pixels/frame  layer pixels/frame\n");
+    for (const bool culling : {false, true}) {
+      const auto r = RunDrag(ids.back(), steps, culling);
+      PrintToFD(*_files[1], "%-7s %9lu %13lu %19lu\n", culling ? "on" : "off",
+          r.frame_ns / 1000, r.pixels, r.layer_pixels);
+    }
+
+    for (auto id : ids) {
+      CloseLayer(id);
+    }
+    __asm__("cli");
+    active_layer->Activate(prev_active);
+    __asm__("sti");
+  }else if(strcmp(command, "gfxbench") == 0){
+    //drawing throughput into a 640x480 window, the way apps draw
+    Window window{640, 480, screen_frame_buffer_config.pixel_format};
+    const uint64_t kRunNanoseconds = 250'000'000;
+    uint64_t pixels = 0, elapsed = 0;
+    const auto start = MonotonicNanoseconds();
+    for (int i = 0; elapsed < kRunNanoseconds; ++i) {
+      FillRectangle(*window.Writer(), {0, 0}, window.Size(),
+          PixelColor{static_cast<uint8_t>(i), 0x40, 0x80});
+      pixels += window.Width() * window.Height();
+      elapsed = MonotonicNanoseconds() - start;
+    }
+    PrintToFD(*_files[1], "FillRectangle: %lu Mpixels/s\n", pixels * 1000 / elapsed);
+
+    //compositing a transparent window and a color-keyed one, like the
+    //mouse cursor, into the back buffer
+    FrameBufferConfig config{nullptr, 0, 640, 480, screen_frame_buffer_config.pixel_format};
+    FrameBuffer src, dst;
+    src.Initialize(config);
+    dst.Initialize(config);
+    for (int y = 0; y < 480; ++y) {
+      for (int x = 0; x < 640; ++x) {
+        src.Writer().Write({x, y}, (x / 8 + y / 8) % 2
+            ? PixelColor{0, 0, 0} : PixelColor{0x40, 0x80, static_cast<uint8_t>(x)});
+      }
+    }
+    const struct {
+      const char* name;
+      uint8_t alpha;
+      std::optional<PixelColor> key;
+    } paths[] = {
+      {"AlphaBlend", globalTransparentDefaultAplha, std::nullopt},
+      {"ColorKey", 0xff, PixelColor{0, 0, 0}},
+    };
+    for (const auto& path : paths) {
+      pixels = 0;
+      elapsed = 0;
+      const auto path_start = MonotonicNanoseconds();
+      while (elapsed < kRunNanoseconds) {
+        dst.Blend({0, 0}, src, {{0, 0}, {640, 480}}, path.alpha, path.key);
+        pixels += 640 * 480;
+        elapsed = MonotonicNanoseconds() - path_start;
+      }
+      PrintToFD(*_files[1], "%s: %lu Mpixels/s\n", path.name, pixels * 1000 / elapsed);
+    }
+  }else if(strcmp(command, "timerstat") == 0){
+    //rates since the previous timerstat, or since boot
+    static TimerStat last_stat{};
+    static unsigned long last_tick = 0;
+    __asm__("cli");
+    const auto stat = timer_stat;
+    const auto tick = timer_manager->CurrentTick();
+    __asm__("sti");
+    const auto elapsed = std::max(tick - last_tick, 1ul);
+
+    PrintToFD(*_files[1], "cpu  interrupts/s  idle wakeups/s\n");
+    for (int cpu = 0; cpu < CPUCount(); ++cpu) {
+      PrintToFD(*_files[1], "%3d %13lu %15lu\n", cpu,
+          (stat.interrupts[cpu] - last_stat.interrupts[cpu]) * kTimerFreq / elapsed,
+          (stat.idle_interrupts[cpu] - last_stat.idle_interrupts[cpu]) * kTimerFreq / elapsed);
+    }
+    const auto expired = stat.expired - last_stat.expired;
+    PrintToFD(*_files[1], "timers: %lu expired, lateness avg %lu us, max %lu us\n",
+        expired, expired ? (stat.lateness_sum - last_stat.lateness_sum) / expired : 0,
+        stat.lateness_max);
+    last_stat = stat;
+    last_tick = tick;
+  }else if(strcmp(command, "latency") == 0){
+    //input-to-photon latency of the mouse cursor since boot
+    __asm__("cli");
+    const auto stat = input_latency_stat;
+    uint64_t throttles = 0;
+    task_manager->ForEachTask([&throttles](Task& task) {
+      if (task.ID() == 1) {
+        throttles = task.Throttles();
+      }
+    });
+    __asm__("sti");
+    PrintToFD(*_files[1], "input to photon: %lu moves, avg %lu us, max %lu us\n",
+        stat.count, stat.count ? stat.sum_ns / stat.count / 1000 : 0, stat.max_ns / 1000);
+    PrintToFD(*_files[1], "main task out of runtime: %lu times\n", throttles);
+    for (size_t i = 0; i < stat.histogram.size(); ++i) {
+      PrintToFD(*_files[1], "%s%4lu ms: %lu\n",
+          i + 1 < stat.histogram.size() ? "< " : ">=",
+          i + 1 < stat.histogram.size() ? 1ul << i : 1ul << (i - 1),
+          stat.histogram[i]);
+    }
+  }else if(strcmp(command, "fps") == 0){
+    //compositor rates since the previous fps, or since boot
+    static CompositorStat last_stat{};
+    static unsigned long last_tick = 0;
+    __asm__("cli");
+    const auto stat = compositor_stat;
+    const auto tick = timer_manager->CurrentTick();
+    __asm__("sti");
+    const auto elapsed = std::max(tick - last_tick, 1ul);
+    const auto frames = stat.frames - last_stat.frames;
+
+    PrintToFD(*_files[1], "frames/s: %lu, pixels/s: %lu\n",
+        frames * kTimerFreq / elapsed,
+        (stat.pixels - last_stat.pixels) * kTimerFreq / elapsed);
+    if (frames > 0) {
+      PrintToFD(*_files[1], "per frame: %lu rects, %lu pixels, %lu layer pixels, %lu us\n",
+          (stat.rects - last_stat.rects) / frames,
+          (stat.pixels - last_stat.pixels) / frames,
+          (stat.layer_pixels - last_stat.layer_pixels) / frames,
+          (stat.composite_ns - last_stat.composite_ns) / frames / 1000);
+    }
+    last_stat = stat;
+    last_tick = tick;
+  }else if(strcmp(command, "msgstat") == 0){
+    std::vector<std::pair<uint64_t, MPSCRing<Message>::Stat>> stats;
+    __asm__("cli");
+    task_manager->ForEachTask([&stats](Task& task) {
+      stats.push_back({task.ID(), task.MessageStat()});
+    });
+    __asm__("sti");
+
+    PrintToFD(*_files[1], "task        capacity  count  high_water  dropped  merged\n");
+    for (const auto& [id, m_stat] : stats) {
+      PrintToFD(*_files[1], "%-10lx %9lu %6lu %11lu %8lu %7lu\n", id,
+          m_stat.capacity, m_stat.count, m_stat.high_water,
+          m_stat.dropped, m_stat.merged);
+    }
+    PrintToFD(*_files[1], "merged: %lu mouse moves, %lu layer ops\n",
+        coalesce_stat.mouse_moves, coalesce_stat.layer_ops);
+  }else if(strcmp(command, "waitstat") == 0){
+    //counts since the previous waitstat, or since boot
+    static WaitStat last_stat{};
+    __asm__("cli");
+    const auto stat = wait_stat;
+    __asm__("sti");
+    const auto waits = stat.waits - last_stat.waits;
+    const auto spurious = stat.spurious - last_stat.spurious;
+    PrintToFD(*_files[1], "waits: %lu, wakeups: %lu, spurious: %lu (%lu%%)\n",
+        waits, stat.wakeups - last_stat.wakeups, spurious,
+        waits ? spurious * 100 / waits : 0);
+    last_stat = stat;
+  }else if(strcmp(command, "hugepage") == 0){
+    if(arg && strcmp(arg, "on") == 0){
+      huge_page_enabled = true;
+    }else if(arg && strcmp(arg, "off") == 0){
+      huge_page_enabled = false;
+    }
+    PrintToFD(*_files[1], "hugepage: %s\n", huge_page_enabled ? "on" : "off");
   }else if(strcmp(command, "date") == 0){
     EFI_TIME t;
     uefi_rts->GetTime(&t, nullptr);
@@ -808,12 +1276,24 @@ WithError<int> Terminal::ExecuteFile(fat32::DirectoryEntry& file_entry, char* co
     return { 0, argc.error };
   }
 
-  //user stack
-  const int user_stack_size = 16 * 4096;
-  LinearAddress4Level stack_frame_addr{0xffff'ffff'ffff'f000 - user_stack_size};
-  if (auto err = SetupPageMaps(stack_frame_addr, user_stack_size/4096)) {
+  //clock page, read-only for the app
+  LinearAddress4Level clock_page_addr{CLOCK_PAGE_ADDR};
+  if (auto err = SetupPageMaps(clock_page_addr, 1, false)) {
     return { 0, err };
   }
+  FillClockPage(*reinterpret_cast<ClockPage*>(clock_page_addr.value));
+
+  //user stack, ends on a 2MiB boundary below the args page. it is 2MiB
+  //only when one huge page backs it, otherwise 16 4KiB pages
+  int user_stack_size = 512 * 4096;
+  LinearAddress4Level stack_frame_addr{0xffff'ffff'ffe0'0000 - user_stack_size};
+  if (!huge_page_enabled || SetupHugePageMap(stack_frame_addr)) {
+    user_stack_size = 16 * 4096;
+    stack_frame_addr = LinearAddress4Level{0xffff'ffff'ffe0'0000 - user_stack_size};
+    if (auto err = SetupPageMaps(stack_frame_addr, user_stack_size/4096)) {
+      return { 0, err };
+    }
+  }
   
 
   int ret = -1;
@@ -842,15 +1322,22 @@ WithError<int> Terminal::ExecuteFile(fat32::DirectoryEntry& file_entry, char* co
         (app_load.vaddr_end + 4095) & 0xffff'ffff'ffff'f000;
     task.SetDPagingBegin(elf_next_page);
     task.SetDPagingEnd(elf_next_page);
+    task.DPagingFaultAround() = {false, 1, 0};
+    const auto page_faults = task.PageFaults();
 
     task.SetFileMapEnd(stack_frame_addr.value);
 
     ret = CallApp(argc.value, argv, 3 << 3 | 3, app_load.entry,
         stack_frame_addr.value + user_stack_size - 8,
         &task.OSStackPointer());
+    _last_page_faults = task.PageFaults() - page_faults;
    
     task.Files().clear();
     task.FileMaps().clear();
+    //timers the app did not cancel would wake the next app
+    __asm__("cli");
+    timer_manager->CancelAppTimers(task.ID());
+    __asm__("sti");
   }
 
   // char s[64];
@@ -1054,18 +1541,16 @@ void TaskTerminal(uint64_t task_id, int64_t data){
   bool window_isactive = false;
 
   while (true) {
-    __asm__("cli");
-    auto msg = task.ReceiveMessage();
-    if (!msg) {
-      task.Sleep();
-      __asm__("sti");
-      continue;
-    }
-    __asm__("sti");
-
-    switch (msg->type) {
+    const auto msg = task.WaitMessage();
+    switch (msg.type) {
     case Message::kTimerTimeout:
-      add_blink_timer(msg->arg.timer.timeout);
+      //left over from an app: its own timers or a futex timeout
+      if (msg.arg.timer.value != 1) {
+        break;
+      }
+      __asm__("cli");
+      add_blink_timer(msg.arg.timer.timeout);
+      __asm__("sti");
       if(show_window && window_isactive){
         const auto area = terminal->BlinkCursor();
         Message msg = MakeLayerMessage(
@@ -1077,10 +1562,10 @@ void TaskTerminal(uint64_t task_id, int64_t data){
       }
       break;
     case Message::kKeyPush:
-      if (msg->arg.keyboard.press){
-        const auto area = terminal->InputKey(msg->arg.keyboard.modifier,
-                                             msg->arg.keyboard.keycode,
-                                             msg->arg.keyboard.ascii);
+      if (msg.arg.keyboard.press){
+        const auto area = terminal->InputKey(msg.arg.keyboard.modifier,
+                                             msg.arg.keyboard.keycode,
+                                             msg.arg.keyboard.ascii);
         if(show_window){
           Message msg = MakeLayerMessage(
               task_id, terminal->LayerID(),
@@ -1092,10 +1577,10 @@ void TaskTerminal(uint64_t task_id, int64_t data){
       }
       break;
     case Message::kWindowActive:
-      window_isactive = msg->arg.window_active.activate;
+      window_isactive = msg.arg.window_active.activate;
       break;
     case Message::kWindowClose:
-      CloseLayer(msg->arg.window_close.layer_id);
+      CloseLayer(msg.arg.window_close.layer_id);
       __asm__("cli");
       task_manager->Finish(terminal->LastExitCode());
       break;
@@ -1113,25 +1598,17 @@ size_t TerminalFileDescriptor::Read(void* buf, size_t len) {
   char* bufc = reinterpret_cast<char*>(buf);
 
   while (true) {
-    __asm__("cli");
     // auto msg = _task.ReceiveMessage();
-    auto msg = _term.UnderlyingTask().ReceiveMessage();
-    if (!msg) {
-      //_task.Sleep();
-      _term.UnderlyingTask().Sleep();
-      continue;
-    }
-    __asm__("sti");
-
-     if (msg->type != Message::kKeyPush || !msg->arg.keyboard.press) {
+    const auto msg = _term.UnderlyingTask().WaitMessage();
+     if (msg.type != Message::kKeyPush || !msg.arg.keyboard.press) {
       continue;
     }
 
-    if (msg->arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
+    if (msg.arg.keyboard.modifier & (kLControlBitMask | kRControlBitMask)) {
       char s[3] = "^ ";
-      s[1] = toupper(msg->arg.keyboard.ascii);
+      s[1] = toupper(msg.arg.keyboard.ascii);
       _term.Print(s);
-      if (msg->arg.keyboard.keycode == 7) {
+      if (msg.arg.keyboard.keycode == 7) {
         //ctrl + d
   
         //EOT
@@ -1140,7 +1617,7 @@ size_t TerminalFileDescriptor::Read(void* buf, size_t len) {
       continue;
     }
 
-    bufc[0] = msg->arg.keyboard.ascii;
+    bufc[0] = msg.arg.keyboard.ascii;
     _term.Print(bufc, 1);
     _term.Redraw();
     return 1;
@@ -1158,67 +1635,30 @@ size_t TerminalFileDescriptor::Load(void* buf, size_t len, size_t offset) {
   return 0;
 }
 
-PipeDescriptor::PipeDescriptor(Task& task) : _task{task}{
-}
-
 size_t PipeDescriptor::Read(void* buf, size_t len) {
-  if(_len > 0){
-    const size_t copy_bytes = std::min(_len, len);
-    memcpy(buf, _data, copy_bytes);
-    _len -= copy_bytes;
-    memmove(_data, &_data[copy_bytes], _len);
-    return copy_bytes;
-  }
-
-  if(_closed){
-    return 0;
-  }
-
-  while (true) {
-    __asm__("cli");
-    auto msg = _task.ReceiveMessage();
-    if (!msg) {
-      _task.Sleep();
-      continue;
-    }
-    __asm__("sti");
-
-    if (msg->type != Message::kPipe) {
-      continue;
-    }
-
-    if (msg->arg.pipe.len == 0) {
-      _closed = true;
-      return 0;
-    }
+  __asm__("cli");
+  auto& task = task_manager->CurrentTask();
+  _readers.WaitUntil(task, [this]() { return !_data.empty() || _closed; });
 
-    const size_t copy_bytes = std::min<size_t>(msg->arg.pipe.len, len);
-    memcpy(buf, msg->arg.pipe.data, copy_bytes);
-    _len = msg->arg.pipe.len - copy_bytes;
-    memcpy(_data, &msg->arg.pipe.data[copy_bytes], _len);
-    return copy_bytes;
-  }
+  const size_t copy_bytes = std::min(_data.size(), len);
+  std::copy_n(_data.begin(), copy_bytes, reinterpret_cast<char*>(buf));
+  _data.erase(_data.begin(), _data.begin() + copy_bytes);
+  __asm__("sti");
+  return copy_bytes;
 }
 
 size_t PipeDescriptor::Write(const void* buf, size_t len) {
   auto bufc = reinterpret_cast<const char*>(buf);
-  Message msg{Message::kPipe};
-  size_t sent_bytes = 0;
-  while (sent_bytes < len) {
-    msg.arg.pipe.len = std::min(len - sent_bytes, sizeof(msg.arg.pipe.data));
-    memcpy(msg.arg.pipe.data, &bufc[sent_bytes], msg.arg.pipe.len);
-    sent_bytes += msg.arg.pipe.len;
-    __asm__("cli");
-    _task.SendMessage(msg);
-    __asm__("sti");
-  }
+  __asm__("cli");
+  _data.insert(_data.end(), bufc, bufc + len);
+  _readers.WakeAll();
+  __asm__("sti");
   return len;
 }
 
 void PipeDescriptor::FinishWrite() {
-  Message msg{Message::kPipe};
-  msg.arg.pipe.len = 0;
   __asm__("cli");
-  _task.SendMessage(msg);
+  _closed = true;
+  _readers.WakeAll();
   __asm__("sti");
 }
\ No newline at end of file
@@ -10,6 +10,7 @@
 #include "fat.hpp"
 #include "task.hpp"
 #include "paging.hpp"
+#include "wait_queue.hpp"
 
 struct AppLoadInfo {
   uint64_t vaddr_end, entry;
@@ -71,6 +72,8 @@ class Terminal {
 
      std::array<std::shared_ptr<FileDescriptor>, 3> _files;
      int _last_exit_code{0};
+     //page faults taken by the last app
+     uint64_t _last_page_faults{0};
 };
 
 //task_id to terminal
@@ -93,9 +96,10 @@ class TerminalFileDescriptor : public FileDescriptor {
 };
 
 
+//the writer never blocks, the reader sleeps in _readers until data
+//arrives or the writer finishes
 class PipeDescriptor : public FileDescriptor {
  public:
-  explicit PipeDescriptor(Task& task);
   size_t Read(void* buf, size_t len) override;
   size_t Write(const void* buf, size_t len) override;
   size_t Size() const override { return 0; }
@@ -104,8 +108,7 @@ class PipeDescriptor : public FileDescriptor {
   void FinishWrite();
 
  private:
-  Task& _task;
-  char _data[16];
-  size_t _len{0};
+  std::deque<char> _data{};
   bool _closed{false};
+  WaitQueue _readers{};
 };
\ No newline at end of file
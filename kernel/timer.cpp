@@ -1,16 +1,82 @@
 #include "timer.hpp"
 
+#include <algorithm>
+#include <limits>
+
+#include "asmfunc.h"
 #include "interrupt.hpp"
 #include "acpi.hpp"
+#include "logger.hpp"
 #include "task.hpp"
+#include "smp.hpp"
 
 namespace {
   const uint32_t kCountMax = 0xffffffffu;
-  static bool initialized = false;
   volatile uint32_t& lvt_timer = *reinterpret_cast<uint32_t*>(0xfee00320);
   volatile uint32_t& initial_count = *reinterpret_cast<uint32_t*>(0xfee00380);
   volatile uint32_t& current_count = *reinterpret_cast<uint32_t*>(0xfee00390);
   volatile uint32_t& divide_config = *reinterpret_cast<uint32_t*>(0xfee003e0);
+
+  const unsigned long kNoDeadline = std::numeric_limits<unsigned long>::max();
+  //per CPU: end of the time slice of the running task, and the tick the
+  //LAPIC timer is set to fire at
+  std::array<unsigned long, kMaxCPUs> slice_deadline{};
+  std::array<unsigned long, kMaxCPUs> armed_deadline{};
+
+  uint64_t tsc_freq;
+  uint64_t tsc_start;
+  ClockPage clock_page{};
+
+  void StartLAPICTimer(){
+    initial_count = kCountMax;
+  }
+
+  uint32_t LAPICTimerElapsed(){
+    return kCountMax - current_count;
+  }
+
+  void StopLAPICTimer(){
+    initial_count = 0;
+  }
+
+  //CPUID.80000007H:EDX[bit 8] invariant TSC
+  bool IsTSCInvariant() {
+    uint32_t regs[4];
+    CPUID(0x80000000, 0, regs);
+    if (regs[0] < 0x80000007) {
+      return false;
+    }
+    CPUID(0x80000007, 0, regs);
+    return regs[3] & (1u << 8);
+  }
+
+  //sets the one-shot LAPIC timer of this CPU to fire at deadline,
+  //or stops it when there is nothing to wait for
+  void SetDeadline(int cpu, unsigned long deadline, unsigned long now) {
+    armed_deadline[cpu] = deadline;
+    if (deadline == kNoDeadline) {
+      initial_count = 0;
+      return;
+    }
+    //longer waits fire early and set the timer again
+    const unsigned long ticks =
+        std::min<unsigned long>(deadline > now ? deadline - now : 1, kTimerFreq);
+    const unsigned long count = ticks * lapic_timer_freq / kTimerFreq;
+    initial_count = std::clamp<unsigned long>(count, 1, kCountMax);
+  }
+
+  //earliest of the timers (handled by the BSP), the time slice and
+  //the runtime of deadline tasks
+  void ArmLAPICTimer(int cpu, unsigned long now) {
+    unsigned long deadline = cpu == 0 ? timer_manager->NextTimeout() : kNoDeadline;
+    if (task_manager) {
+      if (task_manager->TimeSliceNeeded()) {
+        deadline = std::min(deadline, slice_deadline[cpu]);
+      }
+      deadline = std::min(deadline, task_manager->NextDeadlineEvent());
+    }
+    SetDeadline(cpu, deadline, now);
+  }
 }
 
 // void InitializeLAPICTimer(std::deque<Message>& msg_queue){
@@ -37,33 +103,50 @@ void InitializeLAPICTimer(){
   vector 32
   */
   lvt_timer = (0b01<<16) | 32;
+  const auto tsc_begin = __builtin_ia32_rdtsc();
   StartLAPICTimer();
   acpi::WaitMilliseconds(100);
   const auto elapsed = LAPICTimerElapsed();
   StopLAPICTimer();
+  tsc_start = __builtin_ia32_rdtsc();
 
   //hz
   lapic_timer_freq = static_cast<unsigned long>(elapsed) * 10;
+  tsc_freq = (tsc_start - tsc_begin) * 10;
+
+  //32.32 fixed point ns per cycle, exact for any realistic frequency
+  clock_page.tsc_base = tsc_start;
+  clock_page.shift = 32;
+  clock_page.mult = (1000000000ul << clock_page.shift) / tsc_freq;
+  clock_page.tsc_invariant = IsTSCInvariant();
+  if (!clock_page.tsc_invariant) {
+    Log(kWarn, "TSC is not invariant, the clock may drift\n");
+  }
+  Log(kDebug, "TSC %lu Hz\n", tsc_freq);
 
-  lvt_timer = (0b10<<16) | InterruptVector::kLAPICTimer;
-  initialized = false;
-  //0.1s
-  initial_count = lapic_timer_freq / kTimerFreq;
+  //one-shot, set to the next deadline
+  lvt_timer = (0b00<<17) | InterruptVector::kLAPICTimer;
+  armed_deadline[0] = kNoDeadline;
 }
 
-bool IsLAPICTimerInitialized(){
-  return initialized;
+void InitializeLAPICTimerForAP(){
+  //the LAPIC timers of all CPUs run at the frequency measured by the BSP
+  divide_config = 0b1011;
+  lvt_timer = (0b00<<17) | InterruptVector::kLAPICTimer;
+  initial_count = 0;
+  armed_deadline[CurrentCPU()] = kNoDeadline;
 }
-void StartLAPICTimer(){
-  initial_count = kCountMax;
+
+void RearmLAPICTimer() {
+  ArmLAPICTimer(CurrentCPU(), timer_manager->CurrentTick());
 }
 
-uint32_t LAPICTimerElapsed(){
-  return kCountMax - current_count;
+uint64_t MonotonicNanoseconds() {
+  return ClockPageNanoseconds(&clock_page);
 }
 
-void StopLAPICTimer(){
-   initial_count = 0;
+void FillClockPage(ClockPage& page) {
+  page = clock_page;
 }
 
 Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
@@ -73,51 +156,226 @@ Timer::Timer(unsigned long timeout, int value, uint64_t task_id)
 // TimerManager::TimerManager(std::deque<Message>& msg_queue)
 //     : _msg_queue{msg_queue}{
 TimerManager::TimerManager(){
-  _timers.push(Timer{std::numeric_limits<unsigned long>::max(), 0, 0});
+  _nodes.emplace_back();
+}
+
+uint64_t TimerManager::AddTimer(const Timer& timer) {
+  uint32_t index;
+  if (_free_nodes.empty()) {
+    index = _nodes.size();
+    _nodes.emplace_back();
+  } else {
+    index = _free_nodes.back();
+    _free_nodes.pop_back();
+  }
+  auto& node = _nodes[index];
+  node.timer = timer;
+  Link(index);
+
+  //the BSP handles the timers, bring its deadline forward
+  if (timer.Timeout() < armed_deadline[0]) {
+    if (CurrentCPU() == 0) {
+      SetDeadline(0, timer.Timeout(), CurrentTick());
+    } else {
+      SendRescheduleIPI(0);
+    }
+  }
+  return static_cast<uint64_t>(node.generation) << 32 | index;
 }
 
-void TimerManager::AddTimer(const Timer& timer) {
-  _timers.push(timer);
+bool TimerManager::CancelTimer(uint64_t handle, uint64_t task_id) {
+  const uint32_t index = handle & 0xffffffffu;
+  if (index == 0 || index >= _nodes.size()) {
+    return false;
+  }
+  auto& node = _nodes[index];
+  if (!node.linked || node.generation != handle >> 32 ||
+      node.timer.TaskID() != task_id) {
+    return false;
+  }
+  //the BSP deadline is left as is, it only wakes up once for nothing
+  Unlink(index);
+  FreeNode(index);
+  return true;
 }
 
-bool TimerManager::Tick() {
-  _tick++;
+void TimerManager::CancelAppTimers(uint64_t task_id) {
+  for (uint32_t index = 1; index < _nodes.size(); ++index) {
+    const auto& node = _nodes[index];
+    if (node.linked && node.timer.TaskID() == task_id && node.timer.Value() < 0) {
+      Unlink(index);
+      FreeNode(index);
+    }
+  }
+}
 
-  bool task_timer_timeout = false;
-  while(true){
-    const auto& t = _timers.top();
-    if(t.Timeout() > _tick){
+unsigned long TimerManager::CurrentTick() const {
+  const uint64_t cycles = __builtin_ia32_rdtsc() - tsc_start;
+  return cycles / tsc_freq * kTimerFreq + cycles % tsc_freq * kTimerFreq / tsc_freq;
+}
+
+void TimerManager::Tick(unsigned long now) {
+  while (true) {
+    //the slot whose time comes first, lower levels win ties
+    int level = -1, slot = -1;
+    unsigned long start = std::numeric_limits<unsigned long>::max();
+    for (int l = 0; l < kLevels; ++l) {
+      const int s = FirstSlot(l);
+      if (s >= 0 && SlotStart(l, s) < start) {
+        level = l;
+        slot = s;
+        start = SlotStart(l, s);
+      }
+    }
+    if (level < 0 || start > now) {
       break;
     }
 
-    if (t.Value() == kTaskTimerValue) {
-      task_timer_timeout = true;
-      _timers.pop();
-      _timers.push(Timer{_tick + kTaskTimerPeriod, kTaskTimerValue, 1});
+    _wheel_time = std::max(_wheel_time, start);
+    uint32_t index = _slots[level][slot];
+    _slots[level][slot] = 0;
+    _occupied[level] &= ~(1ul << slot);
+
+    while (index != 0) {
+      auto& node = _nodes[index];
+      const uint32_t next = node.next;
+      node.linked = false;
+      const auto& t = node.timer;
+      if (t.Timeout() > now) {
+        //cascade to a lower level
+        Link(index);
+        index = next;
+        continue;
+      }
+
+      const auto lateness = now - t.Timeout();
+      timer_stat.expired++;
+      timer_stat.lateness_sum += lateness;
+      timer_stat.lateness_max = std::max(timer_stat.lateness_max, lateness);
+
+      Message m{Message::kTimerTimeout};
+      m.arg.timer.timeout = t.Timeout();
+      m.arg.timer.value = t.Value();
+      // _msg_queue.push_back(m);
+      task_manager->SendMessage(t.TaskID(), m);
+
+      FreeNode(index);
+      index = next;
+    }
+  }
+  _wheel_time = std::max(_wheel_time, now);
+}
+
+unsigned long TimerManager::NextTimeout() const {
+  //timers of a later slot cannot expire before those of the first one
+  unsigned long next = std::numeric_limits<unsigned long>::max();
+  for (int level = 0; level < kLevels; ++level) {
+    const int slot = FirstSlot(level);
+    if (slot < 0) {
       continue;
     }
+    for (auto index = _slots[level][slot]; index != 0; index = _nodes[index].next) {
+      next = std::min(next, _nodes[index].timer.Timeout());
+    }
+  }
+  return next;
+}
+
+void TimerManager::Link(uint32_t index) {
+  auto& node = _nodes[index];
+  //a timeout in the past expires on the next Tick
+  const unsigned long timeout = std::max(node.timer.Timeout(), _wheel_time);
+  const unsigned long diff = timeout ^ _wheel_time;
+  const int level = diff == 0 ? 0 : (63 - __builtin_clzl(diff)) / kSlotBits;
+  const int slot = (timeout >> (level * kSlotBits)) & (kSlots - 1);
+
+  node.level = level;
+  node.slot = slot;
+  node.prev = 0;
+  node.next = _slots[level][slot];
+  if (node.next != 0) {
+    _nodes[node.next].prev = index;
+  }
+  _slots[level][slot] = index;
+  _occupied[level] |= 1ul << slot;
+  node.linked = true;
+}
+
+void TimerManager::Unlink(uint32_t index) {
+  auto& node = _nodes[index];
+  if (node.prev != 0) {
+    _nodes[node.prev].next = node.next;
+  } else {
+    _slots[node.level][node.slot] = node.next;
+  }
+  if (node.next != 0) {
+    _nodes[node.next].prev = node.prev;
+  }
+  if (_slots[node.level][node.slot] == 0) {
+    _occupied[node.level] &= ~(1ul << node.slot);
+  }
+  node.linked = false;
+}
 
-    Message m{Message::kTimerTimeout};
-    m.arg.timer.timeout = t.Timeout();
-    m.arg.timer.value = t.Value();
-    // _msg_queue.push_back(m);
-    task_manager->SendMessage(t.TaskID(), m);
+void TimerManager::FreeNode(uint32_t index) {
+  //handles of the freed timer no longer match
+  _nodes[index].generation++;
+  _free_nodes.push_back(index);
+}
 
-    _timers.pop();
+int TimerManager::FirstSlot(int level) const {
+  //a timer shares the bits above its level with _wheel_time and is not
+  //earlier, so no slot before the current one of the level is occupied
+  if (_occupied[level] == 0) {
+    return -1;
   }
+  return __builtin_ctzl(_occupied[level]);
+}
 
-  return task_timer_timeout;
+unsigned long TimerManager::SlotStart(int level, int slot) const {
+  const int shift = level * kSlotBits;
+  const int upper_shift = shift + kSlotBits;
+  const unsigned long base = upper_shift >= 64 ? 0 : _wheel_time >> upper_shift << upper_shift;
+  return base + (static_cast<unsigned long>(slot) << shift);
 }
 
 TimerManager* timer_manager;
+bool profile_timing = false;
 unsigned long lapic_timer_freq;
+TimerStat timer_stat{};
 
 extern "C" void LAPICTimerOnInterrupt(const TaskContext& ctx_stack){
-  const bool task_timer_timeout = timer_manager->Tick();
+  //interrupted kernel code holds the lock, give it to waiting CPUs in turn
+  const bool acquired = AcquireKernelLock();
+  if (!acquired) {
+    YieldKernelLock();
+  }
+
+  const int cpu = CurrentCPU();
+  const auto now = timer_manager->CurrentTick();
+  timer_stat.interrupts[cpu]++;
+  if (cpu == 0) {
+    timer_manager->Tick(now);
+  }
   NotifyEndOfInterrupt();
 
-  if (task_timer_timeout) {
-    // SwitchTask();
-    task_manager->SwitchTask(ctx_stack);
+  if (task_manager) {
+    if (task_manager->CurrentTask().Level() == 0) {
+      timer_stat.idle_interrupts[cpu]++;
+    }
+    //the time slice is over, a task woke up that should run first, or
+    //a deadline task ran out of runtime or starts a period
+    if (now >= slice_deadline[cpu] || task_manager->LevelChanged() ||
+        now >= task_manager->NextDeadlineEvent()) {
+      slice_deadline[cpu] = now + kTaskTimerPeriod;
+      //the switch, which does not return, sets the timer again
+      // SwitchTask();
+      task_manager->SwitchTask(ctx_stack);
+    }
+  }
+  ArmLAPICTimer(cpu, now);
+
+  if (acquired) {
+    ReleaseKernelLock();
   }
 }
\ No newline at end of file
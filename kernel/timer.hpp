@@ -1,15 +1,24 @@
 #include <cstdint>
-#include <queue>
+#include <vector>
+#include <array>
 
+#include "clock_page.hpp"
 #include "message.hpp"
+#include "smp.hpp"
 
 
 // void InitializeLAPICTimer(std::deque<Message>& msg_queue);
 void InitializeLAPICTimer();
-bool IsLAPICTimerInitialized();
-void StartLAPICTimer();
-uint32_t LAPICTimerElapsed();
-void StopLAPICTimer();
+void InitializeLAPICTimerForAP();
+//sets the LAPIC timer of this CPU for its run queue after a task switch
+void RearmLAPICTimer();
+
+//nanoseconds from the TSC, calibrated against the ACPI PM timer
+uint64_t MonotonicNanoseconds();
+//writes the TSC conversion of MonotonicNanoseconds for an app
+void FillClockPage(ClockPage& page);
+//printk and the mouse log how long they take when set
+extern bool profile_timing;
 
 class Timer{
   public:
@@ -24,31 +33,74 @@ class Timer{
     uint64_t _task_id;
 };
 
-inline bool operator<(const Timer& lhs, const Timer& rhs){
-  return lhs.Timeout() > rhs.Timeout();
-}
-
 class TimerManager {
   public:
     // TimerManager(std::deque<Message>& msg_queue);
     TimerManager();
-    void AddTimer(const Timer& timer);
+    //returns a handle for CancelTimer, never 0
+    uint64_t AddTimer(const Timer& timer);
+    //false if the timer of task_id already expired or was cancelled
+    bool CancelTimer(uint64_t handle, uint64_t task_id);
+    //cancels the timers an app (negative values) left in the task
+    void CancelAppTimers(uint64_t task_id);
 
-    bool Tick();
-    unsigned long CurrentTick() const { return _tick; }
+    //sends the messages of the timers due at now
+    void Tick(unsigned long now);
+    //microseconds since the LAPIC timer was calibrated, read from the TSC
+    unsigned long CurrentTick() const;
+    //timeout of the earliest timer, max of unsigned long if none
+    unsigned long NextTimeout() const;
 
  private:
-  volatile unsigned long _tick{0};
-  std::priority_queue<Timer> _timers{};
+  //hierarchical timer wheel, level l has 64 slots of 64^l ticks each.
+  //A timer sits at the lowest level where its timeout differs from
+  //_wheel_time only in the bits of that level, and moves down a level
+  //when _wheel_time reaches the start of its slot
+  static const int kSlotBits = 6;
+  static const int kSlots = 1 << kSlotBits;
+  static const int kLevels = (64 + kSlotBits - 1) / kSlotBits;
+
+  //handle: generation << 32 | node index, node 0 is never used
+  struct Node {
+    Timer timer{0, 0, 0};
+    uint32_t generation{0};
+    //list of the slot, 0 ends it
+    uint32_t prev{0}, next{0};
+    uint8_t level{0}, slot{0};
+    bool linked{false};
+  };
+  std::vector<Node> _nodes{};
+  std::vector<uint32_t> _free_nodes{};
+  std::array<std::array<uint32_t, kSlots>, kLevels> _slots{};
+  //bit n: slot n of the level is not empty
+  std::array<uint64_t, kLevels> _occupied{};
+  unsigned long _wheel_time{0};
+
+  void Link(uint32_t index);
+  void Unlink(uint32_t index);
+  void FreeNode(uint32_t index);
+  //first non-empty slot of the level, -1 if none
+  int FirstSlot(int level) const;
+  unsigned long SlotStart(int level, int slot) const;
   // std::deque<Message>& _msg_queue;
 };
 
 extern TimerManager* timer_manager;
 extern unsigned long lapic_timer_freq;
-const int kTimerFreq = 100;
+//ticks are microseconds, the LAPIC timer only fires at the next deadline
+const int kTimerFreq = 1000000;
 
 const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 0.02);
 // const int kTaskTimerPeriod = static_cast<int>(kTimerFreq * 1.0);
-const int kTaskTimerValue = std::numeric_limits<int>::min();
+
+struct TimerStat {
+  //timers handled, and how late (ticks) after their timeout
+  unsigned long expired, lateness_sum, lateness_max;
+  //LAPIC timer and reschedule interrupts per CPU, and those that
+  //interrupted the idle task
+  std::array<unsigned long, kMaxCPUs> interrupts, idle_interrupts;
+};
+
+extern TimerStat timer_stat;
 
 // void LAPICTimerOnInterrupt();
\ No newline at end of file
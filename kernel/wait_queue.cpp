@@ -0,0 +1,71 @@
+#include "wait_queue.hpp"
+
+#include <algorithm>
+#include <map>
+
+#include "slab.hpp"
+#include "task.hpp"
+
+namespace {
+  //a key's queue lives while a task is inside WaitOnKey for it, woken
+  //tasks still count until they return
+  struct KeyedQueue {
+    WaitQueue queue;
+    int users;
+  };
+
+  using KeyedQueueMap = std::map<uint64_t, KeyedQueue, std::less<uint64_t>,
+      SlabAllocator<std::pair<const uint64_t, KeyedQueue>>>;
+  KeyedQueueMap* keyed_queues;
+}
+
+WaitStat wait_stat;
+
+bool WaitQueue::Wait(Task& task) {
+  _waiters.push_back(&task);
+  wait_stat.waits++;
+  task.Sleep();
+
+  auto iter = std::find(_waiters.begin(), _waiters.end(), &task);
+  if (iter == _waiters.end()) {
+    return true;
+  }
+  _waiters.erase(iter);
+  return false;
+}
+
+size_t WaitQueue::Wake(size_t num_tasks) {
+  size_t woken = 0;
+  while (woken < num_tasks && !_waiters.empty()) {
+    Task* task = _waiters.front();
+    _waiters.pop_front();
+    task->Wakeup();
+    woken++;
+  }
+  wait_stat.wakeups += woken;
+  return woken;
+}
+
+bool WaitOnKey(Task& task, uint64_t key) {
+  if (keyed_queues == nullptr) {
+    keyed_queues = new KeyedQueueMap;
+  }
+  auto iter = keyed_queues->try_emplace(key, KeyedQueue{{}, 0}).first;
+  iter->second.users++;
+  const bool woken = iter->second.queue.Wait(task);
+  if (--iter->second.users == 0) {
+    keyed_queues->erase(iter);
+  }
+  return woken;
+}
+
+size_t WakeKey(uint64_t key, size_t num_tasks) {
+  if (keyed_queues == nullptr) {
+    return 0;
+  }
+  auto iter = keyed_queues->find(key);
+  if (iter == keyed_queues->end()) {
+    return 0;
+  }
+  return iter->second.queue.Wake(num_tasks);
+}
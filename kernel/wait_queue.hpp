@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+
+class Task;
+
+struct WaitStat {
+  //sleeps in WaitQueue::Wait and Task::WaitMessage
+  uint64_t waits;
+  //tasks Wake took off a queue
+  uint64_t wakeups;
+  //waits that ended with nothing to do: the condition still false, or
+  //no message
+  uint64_t spurious;
+};
+
+extern WaitStat wait_stat;
+
+//tasks blocked until something happens to one object. Callers disable
+//interrupts, check their condition and Wait while it is false. Wake
+//after changing the state the condition reads.
+class WaitQueue {
+  public:
+    //puts task, the current task, to sleep. A message to the task also
+    //ends the wait. Returns true when Wake took it off the queue
+    bool Wait(Task& task);
+    //returns the number of tasks woken
+    size_t Wake(size_t num_tasks);
+    size_t WakeAll() { return Wake(_waiters.size()); }
+    bool Empty() const { return _waiters.empty(); }
+
+    //returns with interrupts disabled and pred() true
+    template <class Pred>
+    void WaitUntil(Task& task, Pred pred) {
+      if (pred()) {
+        return;
+      }
+      while (true) {
+        Wait(task);
+        __asm__("cli");
+        if (pred()) {
+          return;
+        }
+        wait_stat.spurious++;
+      }
+    }
+
+  private:
+    std::deque<Task*> _waiters{};
+};
+
+//wait queues made on demand for a key: the physical address of a futex
+//word, or kLayerWaitKey | layer ID. Same contract as WaitQueue
+bool WaitOnKey(Task& task, uint64_t key);
+size_t WakeKey(uint64_t key, size_t num_tasks);
+
+const uint64_t kLayerWaitKey = 1ul << 63;
+const size_t kWakeAll = ~size_t{0};
+
+template <class Pred>
+void WaitOnKeyUntil(Task& task, uint64_t key, Pred pred) {
+  if (pred()) {
+    return;
+  }
+  while (true) {
+    WaitOnKey(task, key);
+    __asm__("cli");
+    if (pred()) {
+      return;
+    }
+    wait_stat.spurious++;
+  }
+}
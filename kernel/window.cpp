@@ -70,11 +70,6 @@ uint8_t globalTransparent = 0xff;
 
 Window::Window(int width, int height, PixelFormat shadow_format) 
     : _width{width}, _height{height}{
-  _data.resize(height);
-  for(int y=0; y<height; y++){
-    _data[y].resize(width);
-  }
-
   FrameBufferConfig config{};
   config.frame_buffer = nullptr;
   config.horizontal_resolution = width;
@@ -95,36 +90,13 @@ void Window::DrawTo(FrameBuffer& dst, Vector2D<int> pos, const Rectangle<int>& a
     return;
   }
   
+  const Rectangle<int> src_area{intersection_area.pos - pos, intersection_area.size};
   if(!_transparent_color && !transparent){
-    dst.Copy(intersection_area.pos, _shadow_buffer,
-        {intersection_area.pos - pos, intersection_area.size});
+    dst.Copy(intersection_area.pos, _shadow_buffer, src_area);
   }else{
-    const PixelColor* tc = nullptr;
-    if(_transparent_color){
-      tc = &_transparent_color.value();
-    }
-    auto& writer = dst.Writer();
-    auto alphablend = [](const PixelColor& fgColor,const PixelColor& bgColor,uint8_t alpha){
-      return fgColor * (alpha*1.0/255) + bgColor*(1- alpha*1.0/255);
-    };
-
-    auto delta_pos =  intersection_area.pos - pos;
-    for(int y = std::max(0,0-intersection_area.pos.y); 
-        y < std::min(intersection_area.size.y,writer.Height() - intersection_area.pos.y); y++){
-      for(int x = std::max(0,0-intersection_area.pos.x); 
-          x < std::min(intersection_area.size.x, writer.Width() - intersection_area.pos.x); x++){
-
-        const auto c = At(Vector2D<int>{x + delta_pos.x,y + delta_pos.y});
-        if(tc==nullptr || c != *tc){
-          auto pixelColor = c;
-          if(transparent){
-            auto bgc = writer.GetPixel(intersection_area.pos + Vector2D<int>{x, y});
-            pixelColor = alphablend(c,bgc,globalTransparent);
-          }
-          writer.Write(intersection_area.pos + Vector2D<int>{x, y}, pixelColor);
-        }
-      }
-    }
+    //whole scanlines at once, the color key and alpha on SIMD registers
+    dst.Blend(intersection_area.pos, _shadow_buffer, src_area,
+        transparent ? globalTransparent : 0xff, _transparent_color);
   }
 }
 
@@ -132,17 +104,20 @@ void Window::SetTransparentColor(std::optional<PixelColor> c){
   _transparent_color = c;
 }
 
+bool Window::HasTransparentColor() const{
+  return _transparent_color.has_value();
+}
+
 
  Window::WindowWriter* Window::Writer(){
   return &_writer;
 }
 
-const PixelColor& Window::At(Vector2D<int> pos) const{
-  return _data[pos.y][pos.x];
+PixelColor Window::At(Vector2D<int> pos){
+  return _shadow_buffer.Writer().GetPixel(pos);
 }
 
 void Window::Write(Vector2D<int> pos, PixelColor c){
-  _data[pos.y][pos.x] = c;
   _shadow_buffer.Writer().Write(pos, c);
 }
 
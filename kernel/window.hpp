@@ -42,6 +42,18 @@ class Window{
           Window* _window =container_of(this, Window, _writer);
           return _window->At(pos);
         }
+
+        //one container_of per span, then the spans of the shadow buffer
+        virtual void FillSpan(Vector2D<int> pos, int n, const PixelColor& c) override{
+          ShadowWriter().FillSpan(pos, n, c);
+        }
+        virtual void BlitSpan(Vector2D<int> pos, const PixelColor* colors, int n) override{
+          ShadowWriter().BlitSpan(pos, colors, n);
+        }
+        virtual void BlitMask1bpp(Vector2D<int> pos, const uint8_t* bits, int n,
+                                  const PixelColor& c) override{
+          ShadowWriter().BlitMask1bpp(pos, bits, n, c);
+        }
         
         virtual int Width() override { 
           Window* _window = container_of(this, Window, _writer);
@@ -51,6 +63,11 @@ class Window{
            Window* _window = container_of(this, Window, _writer);
           return _window->Height(); 
           }
+
+      private:
+        FrameBufferWriter& ShadowWriter() {
+          return container_of(this, Window, _writer)->_shadow_buffer.Writer();
+        }
     };
 
     Window(int width, int height, PixelFormat shadow_format);
@@ -60,8 +77,9 @@ class Window{
 
     void DrawTo(FrameBuffer& writer, Vector2D<int> pos, const Rectangle<int>& area, bool transparent);
     void SetTransparentColor(std::optional<PixelColor> c);
+    bool HasTransparentColor() const;
     WindowWriter* Writer();
-    const PixelColor& At(Vector2D<int> pos) const;
+    PixelColor At(Vector2D<int> pos);
     void Write(Vector2D<int> pos, PixelColor c);
 
     int Width() const;
@@ -76,9 +94,9 @@ class Window{
 
   private:
     int _width, _height;
-    std::vector<std::vector<PixelColor>> _data{};
     WindowWriter _writer{};
     std::optional<PixelColor> _transparent_color{std::nullopt};
+    //the only copy of the pixels, in the pixel format of the screen
     FrameBuffer _shadow_buffer{};
 };
 
@@ -101,6 +119,17 @@ class ToplevelWindow : public Window {
       return _window.At(pos+kTopLeftMargin);
     }
 
+    virtual void FillSpan(Vector2D<int> pos, int n, const PixelColor& c) override {
+      _window.Writer()->FillSpan(pos + kTopLeftMargin, n, c);
+    }
+    virtual void BlitSpan(Vector2D<int> pos, const PixelColor* colors, int n) override {
+      _window.Writer()->BlitSpan(pos + kTopLeftMargin, colors, n);
+    }
+    virtual void BlitMask1bpp(Vector2D<int> pos, const uint8_t* bits, int n,
+                              const PixelColor& c) override {
+      _window.Writer()->BlitMask1bpp(pos + kTopLeftMargin, bits, n, c);
+    }
+
     virtual int Width() override {
       return _window.Width() - kTopLeftMargin.x - kBottomRightMargin.x; }
     virtual int Height() override {